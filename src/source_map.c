@@ -0,0 +1,142 @@
+#include "vcdiff_incremental.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define NUM_BUCKETS 64
+
+// a mapped base file, shared by every source stream over the same version
+// of the file
+struct source_map {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  uint8_t *data;
+  // kept open so segments can refer to the file by descriptor
+  int fd;
+  size_t refcount;
+  struct source_map *next;
+};
+
+static struct source_map *buckets[NUM_BUCKETS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int map_flags;
+
+void set_source_map_flags(int flags) { atomic_store(&map_flags, flags); }
+
+static size_t bucket(dev_t dev, ino_t ino) {
+  uint64_t h = (uint64_t)ino * 0x9E3779B97F4A7C15ull ^ (uint64_t)dev;
+  return (h ^ (h >> 32)) % NUM_BUCKETS;
+}
+
+static struct source_map *find(const struct stat *st) {
+  for (struct source_map *map = buckets[bucket(st->st_dev, st->st_ino)]; map;
+       map = map->next) {
+    if (map->dev == st->st_dev && map->ino == st->st_ino &&
+        map->size == st->st_size &&
+        map->mtime.tv_sec == st->st_mtim.tv_sec &&
+        map->mtime.tv_nsec == st->st_mtim.tv_nsec)
+      return map;
+  }
+  return NULL;
+}
+
+static void use(struct source_stream *source, struct source_map *map) {
+  map->refcount++;
+  source->map = map;
+  source->data = map->data;
+  source->len = map->size;
+  source->fd = map->fd;
+}
+
+int map_source(struct source_stream source[static 1], int fd_source) {
+  struct stat st;
+  if (fstat(fd_source, &st) < 0)
+    return -errno;
+
+  pthread_mutex_lock(&lock);
+  struct source_map *map = find(&st);
+  if (map) {
+    use(source, map);
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  pthread_mutex_unlock(&lock);
+
+  // mapped without the lock since populating reads the whole file
+  int flags = atomic_load(&map_flags);
+  uint8_t *data = mmap(NULL, st.st_size, PROT_READ,
+                       MAP_PRIVATE |
+                           (flags & SOURCE_MAP_POPULATE ? MAP_POPULATE : 0),
+                       fd_source, 0);
+  if (data == MAP_FAILED)
+    return -errno;
+  // file backed huge pages need CONFIG_READ_ONLY_THP_FOR_FS, ignored if not
+  if (flags & SOURCE_MAP_HUGEPAGE)
+    madvise(data, st.st_size, MADV_HUGEPAGE);
+  int fd = fcntl(fd_source, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0) {
+    int rc = -errno;
+    munmap(data, st.st_size);
+    return rc;
+  }
+
+  pthread_mutex_lock(&lock);
+  map = find(&st);
+  if (map) {
+    // mapped by another stream in the meantime
+    use(source, map);
+    pthread_mutex_unlock(&lock);
+    munmap(data, st.st_size);
+    close(fd);
+    return 0;
+  }
+  map = malloc(sizeof(struct source_map));
+  if (map == NULL) {
+    pthread_mutex_unlock(&lock);
+    munmap(data, st.st_size);
+    close(fd);
+    return -ENOMEM;
+  }
+  size_t i = bucket(st.st_dev, st.st_ino);
+  *map = (struct source_map){.dev = st.st_dev,
+                             .ino = st.st_ino,
+                             .size = st.st_size,
+                             .mtime = st.st_mtim,
+                             .data = data,
+                             .fd = fd,
+                             .next = buckets[i]};
+  buckets[i] = map;
+  use(source, map);
+  pthread_mutex_unlock(&lock);
+  return 0;
+}
+
+int unmap_source(struct source_stream source[static 1]) {
+  struct source_map *map = source->map;
+  if (map == NULL)
+    return 0;
+  source->map = NULL;
+
+  pthread_mutex_lock(&lock);
+  if (--map->refcount > 0) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  struct source_map **link = &buckets[bucket(map->dev, map->ino)];
+  while (*link != map)
+    link = &(*link)->next;
+  *link = map->next;
+  pthread_mutex_unlock(&lock);
+
+  int rc = munmap(map->data, map->size) < 0 ? -errno : 0;
+  close(map->fd);
+  free(map);
+  return rc;
+}
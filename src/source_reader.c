@@ -0,0 +1,287 @@
+#include "vcdiff_incremental.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+
+// O_DIRECT reads must be aligned to the logical block size of the device
+#define DIRECT_ALIGN 4096
+
+// a source piece of the range being read
+struct pending {
+  uint8_t *dest;
+  size_t len;
+  size_t offset;
+  // where the aligned read for dest starts in the bounce buffer
+  size_t bounce_pos;
+};
+
+struct source_reader {
+  struct io_uring ring;
+  unsigned depth;
+  int direct;
+  struct pending *pending;
+  size_t num_pending;
+  size_t capacity;
+  // reused between reads, O_DIRECT reads land here before being copied
+  uint8_t *bounce;
+  size_t bounce_len;
+  // the ring could not be set up again, sources are read synchronously
+  int broken;
+};
+
+int source_reader_new(struct source_reader **reader, unsigned depth,
+                      int direct) {
+  struct source_reader *new = calloc(1, sizeof(struct source_reader));
+  if (new == NULL)
+    return -ENOMEM;
+  int rc = io_uring_queue_init(depth, &new->ring, 0);
+  if (rc < 0) {
+    free(new);
+    return rc;
+  }
+  new->depth = depth;
+  new->direct = direct;
+  *reader = new;
+  return 0;
+}
+
+void source_reader_free(struct source_reader *reader) {
+  if (reader == NULL)
+    return;
+  if (!reader->broken)
+    io_uring_queue_exit(&reader->ring);
+  free(reader->pending);
+  free(reader->bounce);
+  free(reader);
+}
+
+static int add_pending(struct source_reader *reader, uint8_t *dest,
+                       const struct segment *segment) {
+  if (reader->num_pending == reader->capacity) {
+    size_t capacity = 2 * reader->capacity + 16;
+    struct pending *grown =
+        realloc(reader->pending, capacity * sizeof(struct pending));
+    if (grown == NULL)
+      return -ENOMEM;
+    reader->pending = grown;
+    reader->capacity = capacity;
+  }
+  reader->pending[reader->num_pending++] = (struct pending){
+      .dest = dest, .len = segment->len, .offset = segment->source_offset};
+  return 0;
+}
+
+static size_t align_down(size_t value) { return value & ~(DIRECT_ALIGN - 1); }
+
+static size_t align_up(size_t value) {
+  return (value + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1);
+}
+
+static int reserve_bounce(struct source_reader *reader) {
+  size_t len = 0;
+  for (size_t i = 0; i < reader->num_pending; i++) {
+    struct pending *pending = &reader->pending[i];
+    pending->bounce_pos = len;
+    len += align_up(pending->offset + pending->len) -
+           align_down(pending->offset);
+  }
+  if (len <= reader->bounce_len)
+    return 0;
+
+  free(reader->bounce);
+  reader->bounce_len = 0;
+  if (posix_memalign((void **)&reader->bounce, DIRECT_ALIGN, len) != 0) {
+    reader->bounce = NULL;
+    return -ENOMEM;
+  }
+  reader->bounce_len = len;
+  return 0;
+}
+
+// where the read for pending goes and how much of it is needed
+static void read_args(struct source_reader *reader, struct pending *pending,
+                      uint8_t **buf, size_t *len, size_t *offset,
+                      size_t *needed) {
+  if (reader->direct) {
+    *offset = align_down(pending->offset);
+    *buf = reader->bounce + pending->bounce_pos;
+    *len = align_up(pending->offset + pending->len) - *offset;
+    *needed = pending->offset + pending->len - *offset;
+  } else {
+    *offset = pending->offset;
+    *buf = pending->dest;
+    *len = *needed = pending->len;
+  }
+}
+
+// a ring left with reads that were never submitted or never completed is
+// replaced, so nothing of a failed batch is matched against the next one
+static void reset_ring(struct source_reader *reader) {
+  io_uring_queue_exit(&reader->ring);
+  reader->broken = io_uring_queue_init(reader->depth, &reader->ring, 0) < 0;
+}
+
+// finishes a read that came back short, O_DIRECT reads have to start aligned
+// so the partly read block is read again
+static int finish_read(struct source_reader *reader, int fd_source,
+                       struct pending *pending, size_t got) {
+  uint8_t *buf;
+  size_t len, offset, needed;
+  read_args(reader, pending, &buf, &len, &offset, &needed);
+  while (got < needed) {
+    size_t at = reader->direct ? align_down(got) : got;
+    ssize_t n = pread(fd_source, buf + at, len - at, offset + at);
+    if (n < 0)
+      return -errno;
+    if (at + n <= got)
+      return -EIO;
+    got = at + n;
+  }
+  return 0;
+}
+
+// submits up to depth reads at a time and waits for all of them
+static int submit_pending(struct source_reader *reader, int fd_source) {
+  for (size_t first = 0; first < reader->num_pending;) {
+    size_t count = reader->num_pending - first;
+    if (count > reader->depth)
+      count = reader->depth;
+
+    for (size_t i = first; i < first + count; i++) {
+      struct io_uring_sqe *sqe = io_uring_get_sqe(&reader->ring);
+      uint8_t *buf;
+      size_t len, offset, needed;
+      read_args(reader, &reader->pending[i], &buf, &len, &offset, &needed);
+      io_uring_prep_read(sqe, fd_source, buf, len, offset);
+      io_uring_sqe_set_data64(sqe, i);
+    }
+    int error = 0;
+    size_t submitted = 0;
+    while (submitted < count) {
+      int rc = io_uring_submit(&reader->ring);
+      if (rc == -EINTR)
+        continue;
+      if (rc <= 0) {
+        error = rc < 0 ? rc : -EIO;
+        break;
+      }
+      submitted += rc;
+    }
+
+    // even after an error every submitted read is waited for, the kernel
+    // may still be writing to its buffer
+    for (size_t done = 0; done < submitted; done++) {
+      struct io_uring_cqe *cqe = NULL;
+      int rc;
+      do
+        rc = io_uring_wait_cqe(&reader->ring, &cqe);
+      while (rc == -EINTR);
+      if (rc < 0) {
+        reset_ring(reader);
+        return rc;
+      }
+      size_t i = io_uring_cqe_get_data64(cqe);
+      int res = cqe->res;
+      io_uring_cqe_seen(&reader->ring, cqe);
+
+      if (error < 0)
+        continue;
+      // short reads are rare enough to be finished synchronously
+      error = res < 0 ? res
+                      : finish_read(reader, fd_source, &reader->pending[i], res);
+    }
+    if (submitted < count)
+      reset_ring(reader);
+    if (error < 0)
+      return error;
+    first += count;
+  }
+  return 0;
+}
+
+#define SEGMENTS 64
+
+int read_range_reader(struct target_stream target[static 1],
+                      struct read_cursor *cursor,
+                      struct source_reader *reader, int fd_source,
+                      size_t offset, size_t len, uint8_t dest[static len]) {
+  // prefetching into the page cache would only double O_DIRECT reads
+  if (reader->direct)
+    cursor = NULL;
+  if (reader->broken)
+    return read_range_cursor(target, cursor, offset, len, dest);
+
+  // memory and fills are copied right away, source segments collected
+  reader->num_pending = 0;
+  struct segment segments[SEGMENTS];
+  size_t done = 0;
+  while (done < len) {
+    int rc = map_range_cursor(target, cursor, offset + done, len - done,
+                              segments, SEGMENTS);
+    if (rc < 0)
+      return rc;
+    size_t num_segments = rc;
+    for (size_t i = 0; i < num_segments; i++) {
+      struct segment *segment = &segments[i];
+      if (segment->source_offset != SIZE_MAX) {
+        rc = add_pending(reader, dest + done, segment);
+        if (rc < 0)
+          return rc;
+      } else if (segment->data) {
+        memcpy(dest + done, segment->data, segment->len);
+      } else {
+        memset(dest + done, segment->fill, segment->len);
+      }
+      done += segment->len;
+    }
+    if (num_segments < SEGMENTS)
+      break;
+  }
+  if (reader->num_pending == 0)
+    return done;
+
+  if (reader->direct) {
+    int rc = reserve_bounce(reader);
+    if (rc < 0)
+      return rc;
+  }
+  int rc = submit_pending(reader, fd_source);
+  if (rc < 0)
+    return rc;
+
+  if (reader->direct) {
+    for (size_t i = 0; i < reader->num_pending; i++) {
+      struct pending *pending = &reader->pending[i];
+      memcpy(pending->dest,
+             reader->bounce + pending->bounce_pos +
+                 (pending->offset - align_down(pending->offset)),
+             pending->len);
+    }
+  }
+  return done;
+}
+#else
+int source_reader_new(struct source_reader **reader, unsigned depth,
+                      int direct) {
+  (void)reader;
+  (void)depth;
+  (void)direct;
+  return -ENOTSUP;
+}
+
+void source_reader_free(struct source_reader *reader) { (void)reader; }
+
+int read_range_reader(struct target_stream target[static 1],
+                      struct read_cursor *cursor,
+                      struct source_reader *reader, int fd_source,
+                      size_t offset, size_t len, uint8_t dest[static len]) {
+  (void)reader;
+  (void)fd_source;
+  return read_range_cursor(target, cursor, offset, len, dest);
+}
+#endif
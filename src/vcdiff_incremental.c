@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include "vcdiff_incremental.h"
 
 #include <errno.h>
@@ -12,45 +14,272 @@
 
 #include "vcdiff.h"
 
-static int append_block(struct target_stream *target, size_t pos, size_t size,
-                        uint8_t *data) {
+#define MIN_SLAB_SIZE (64 * 1024)
+#define MAX_SLAB_SIZE (16 * 1024 * 1024)
+
+struct slab {
+  struct slab *next;
+  uint8_t data[];
+};
+
+static uint8_t *arena_alloc(struct arena *arena, size_t size) {
+  if ((size_t)(arena->end - arena->pos) >= size) {
+    uint8_t *data = arena->pos;
+    arena->pos += size;
+    return data;
+  }
+
+  // slabs double in size, large payloads get a slab of their own
+  size_t slab_size = arena->slab_size ? arena->slab_size : MIN_SLAB_SIZE;
+  int dedicated = size > slab_size / 4;
+  if (dedicated)
+    slab_size = size;
+  struct slab *slab = malloc(sizeof(struct slab) + slab_size);
+  if (slab == NULL)
+    return NULL;
+  arena->size += slab_size;
+
+  if (dedicated && arena->slabs) {
+    // keep bumping in the current slab
+    slab->next = arena->slabs->next;
+    arena->slabs->next = slab;
+    return slab->data;
+  }
+  slab->next = arena->slabs;
+  arena->slabs = slab;
+  arena->pos = slab->data + size;
+  arena->end = slab->data + slab_size;
+  if (!dedicated && arena->slab_size < MAX_SLAB_SIZE)
+    arena->slab_size = slab_size * 2;
+  return slab->data;
+}
+
+// hands the slabs of other to arena, their data stays where it is
+static void arena_join(struct arena *arena, struct arena *other) {
+  if (other->slabs == NULL)
+    return;
+  struct slab *last = other->slabs;
+  while (last->next)
+    last = last->next;
+  if (arena->slabs) {
+    // keep bumping in the current slab
+    last->next = arena->slabs->next;
+    arena->slabs->next = other->slabs;
+    arena->size += other->size;
+  } else {
+    *arena = *other;
+  }
+  *other = (struct arena){0};
+}
+
+static void arena_free(struct arena *arena) {
+  struct slab *slab = arena->slabs;
+  while (slab) {
+    struct slab *next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  *arena = (struct arena){0};
+}
+
+// pos entries needed for n blocks, the end plus padding for group scans
+static size_t padded_len(size_t num_blocks) {
+  return (num_blocks + SAMPLE_STRIDE) / SAMPLE_STRIDE * SAMPLE_STRIDE;
+}
+
+static int index_reserve(struct block_index *index, size_t capacity) {
+  uint64_t *pos = realloc(index->pos, padded_len(capacity) * sizeof(uint64_t));
+  if (pos == NULL)
+    return -ENOMEM;
+  index->pos = pos;
+  uint64_t *ref = realloc(index->ref, capacity * sizeof(uint64_t));
+  if (ref == NULL)
+    return -ENOMEM;
+  index->ref = ref;
+  index->capacity = capacity;
+  return 0;
+}
+
+static int index_init(struct block_index *index) {
+  *index = (struct block_index){0};
+  int rc = index_reserve(index, 16);
+  if (rc < 0)
+    return rc;
+  index->pos[0] = 0;
+  return 0;
+}
+
+// trim the index and build the samples, lookups use them from now on
+static int index_finish(struct block_index *index) {
+  size_t num_blocks = index->num_blocks;
+  if (num_blocks > 0 && num_blocks < index->capacity)
+    index_reserve(index, num_blocks);
+  for (size_t i = num_blocks + 1; i < padded_len(num_blocks); i++)
+    index->pos[i] = UINT64_MAX;
+
+  size_t num_samples = (num_blocks + SAMPLE_STRIDE - 1) / SAMPLE_STRIDE;
+  if (num_samples == 0)
+    return 0;
+  index->samples = malloc(num_samples * sizeof(uint64_t));
+  if (index->samples == NULL)
+    return -ENOMEM;
+  for (size_t i = 0; i < num_samples; i++)
+    index->samples[i] = index->pos[i * SAMPLE_STRIDE];
+  index->num_samples = num_samples;
+  return 0;
+}
+
+static void index_free(struct block_index *index) {
+  free(index->pos);
+  free(index->ref);
+  free(index->samples);
+  *index = (struct block_index){0};
+}
+
+// runs reach us materialized, long enough uniform writes are stored as fills
+#define MIN_FILL 32
+
+static int is_fill(const uint8_t *data, size_t size) {
+  return size >= MIN_FILL && data[0] == data[size - 1] &&
+         memcmp(data, data + 1, size - 1) == 0;
+}
+
+// adds a block at pos, or extends the previous one if it continues its
+// data or fill
+static int push_block(struct block_index *index, size_t pos, size_t size,
+                      uint64_t ref) {
+  if (size == 0)
+    return 0;
+
+  size_t num_blocks = index->num_blocks;
+  if (num_blocks > 0) {
+    uint64_t last = index->ref[num_blocks - 1];
+    if (ref & REF_FILL ? last == ref
+                       : last + (pos - index->pos[num_blocks - 1]) == ref) {
+      index->pos[num_blocks] += size;
+      return 0;
+    }
+  }
+
   // realloc by doubling capacity
-  if (target->num_blocks == target->capacity) {
-    target->capacity *= 2;
-    target->blocks =
-        realloc(target->blocks, target->capacity * sizeof(struct block));
-    if (target->blocks == NULL)
-      return -ENOMEM;
+  if (num_blocks == index->capacity) {
+    int rc = index_reserve(index, 2 * index->capacity);
+    if (rc < 0)
+      return rc;
   }
 
-  struct block *block = &target->blocks[target->num_blocks++];
-  *block = (struct block){.pos = pos, .size = size};
-  // make a copy of data
+  index->ref[num_blocks] = ref;
+  index->pos[++index->num_blocks] = pos + size;
+  return 0;
+}
+
+static int append_block(struct target_stream *target, size_t pos, size_t size,
+                        uint8_t *data) {
+  struct block_index *index = &target->index;
+  uint64_t ref;
   if (target->source_flag) {
-    block->data = *(uint8_t **)data;
+    uintptr_t copied = (uintptr_t)*(uint8_t **)data;
+    ref = REF_SOURCE | (uint64_t)(copied - (uintptr_t)target->source_data);
     target->source_flag = 0;
+  } else if (is_fill(data, size)) {
+    ref = REF_FILL | data[0];
+  } else if (target->delta_map && data >= target->delta_map &&
+             data < target->delta_map + target->delta_len &&
+             size <= (size_t)(target->delta_map + target->delta_len - data)) {
+    // add data handed out straight from the mapped delta can stay there
+    ref = (uintptr_t)data;
+    target->mapped_len += size;
   } else {
-    block->data = malloc(size);
-    if (block->data == NULL)
+    // make a copy of data
+    uint8_t *copy = arena_alloc(&target->arena, size);
+    if (copy == NULL)
       return -ENOMEM;
-    memcpy(block->data, data, size);
+    memcpy(copy, data, size);
+    target->data_len += size;
+    ref = (uintptr_t)copy;
   }
-  return 0;
+  return push_block(index, pos, size, ref);
+}
+
+// decodes a delta into the index of its target while it is being read
+struct decoder {
+  pthread_t thread;
+  vcdiff_t ctx;
+  // held for writing while a slice of the delta is decoded, readers walk
+  // the index under it until decoding is done
+  pthread_rwlock_t index_lock;
+  pthread_mutex_t lock;
+  pthread_cond_t progress;
+  // target bytes covered by the index, the final size once done is set
+  size_t decoded;
+  int error;
+  atomic_int done;
+  atomic_int cancel;
+};
+
+static void stop_decoder(struct decoder *decoder) {
+  atomic_store_explicit(&decoder->cancel, 1, memory_order_relaxed);
+  pthread_join(decoder->thread, NULL);
+  pthread_rwlock_destroy(&decoder->index_lock);
+  pthread_mutex_destroy(&decoder->lock);
+  pthread_cond_destroy(&decoder->progress);
+  free(decoder);
 }
 
-static int is_in_source(struct source_stream *source, uint8_t *data) {
-  return data >= source->data && data < source->data + source->len;
+static void free_blocks(struct target_stream *target) {
+  arena_free(&target->arena);
+  // a mapped index belongs to the index file
+  if (target->index_map == NULL)
+    index_free(&target->index);
 }
 
 int free_data(struct target_stream target[static 1],
               struct source_stream source[static 1]) {
-  for (size_t i = 0; i < target->num_blocks; i++) {
-    uint8_t *data = target->blocks[i].data;
-    if (!is_in_source(source, data))
-      free(target->blocks[i].data);
+  if (target->decoder)
+    stop_decoder(target->decoder);
+  if (target->lower) {
+    // deltas below in a chain share the source of the top one
+    struct source_stream shared = {0};
+    free_data(target->lower, &shared);
+    free(target->lower);
+  }
+  free_blocks(target);
+  if (target->index_map)
+    munmap(target->index_map, target->index_len);
+  if (target->windows) {
+    for (size_t i = 0; i < target->num_windows; i++)
+      free_blocks(&target->windows[i].target);
+    free(target->windows);
+    pthread_mutex_destroy(&target->lock);
   }
-  free(target->blocks);
-  return munmap(source->data, source->len);
+  if (target->delta_map)
+    munmap(target->delta_map, target->delta_len);
+  return unmap_source(source);
+}
+
+size_t memory_usage(struct target_stream target[static 1]) {
+  // index files are mapped, so their pages belong to the page cache
+  if (target->index_map)
+    return 0;
+  struct decoder *decoder = target->decoder;
+  if (decoder)
+    pthread_rwlock_rdlock(&decoder->index_lock);
+  const struct block_index *index = &target->index;
+  size_t usage = (padded_len(index->capacity) + index->capacity +
+                  index->num_samples) *
+                     sizeof(uint64_t) +
+                 target->arena.size;
+  for (size_t i = 0; i < target->num_windows; i++) {
+    struct window *window = &target->windows[i];
+    usage += sizeof(struct window);
+    if (atomic_load_explicit(&window->decoded, memory_order_acquire))
+      usage += memory_usage(&window->target);
+  }
+  if (target->lower)
+    usage += memory_usage(target->lower);
+  if (decoder)
+    pthread_rwlock_unlock(&decoder->index_lock);
+  return usage;
 }
 
 static int _target_write(void *dev, uint8_t *data, size_t offset, size_t len) {
@@ -86,75 +315,445 @@ static int _source_read(void *dev, uint8_t *dest, size_t offset, size_t len) {
   if (offset + len > source->len)
     return -EINVAL;
 
+  // the decoder only passes the pointer on, the sources of chained deltas
+  // are not mapped and just hand out their offsets
   source->target->source_flag = 1;
-  *(uint8_t **)dest = source->data + offset;
+  *(uint8_t **)dest = (uint8_t *)((uintptr_t)source->data + offset);
 
   return 0;
 }
 
 static const vcdiff_driver_t source_driver = {.read = _source_read};
 
+// index of the block containing offset, num_blocks if it is past the end
+static size_t find_block(const struct block_index *index, uint64_t offset) {
+  if (offset >= index->pos[index->num_blocks])
+    return index->num_blocks;
+
+  if (index->samples == NULL) {
+    // plain binary search while the index is still being built
+    size_t left = 0;
+    size_t len = index->num_blocks;
+    while (len > 1) {
+      size_t half = len / 2;
+      if (index->pos[left + half] <= offset)
+        left += half;
+      len -= half;
+    }
+    return left;
+  }
+
+  // branchless search for the last sample not past offset
+  const uint64_t *base = index->samples;
+  size_t len = index->num_samples;
+  while (len > 1) {
+    size_t half = len / 2;
+    __builtin_prefetch(base + half / 2);
+    __builtin_prefetch(base + half + half / 2);
+    base = base[half] <= offset ? base + half : base;
+    len -= half;
+  }
+
+  // then count within its group, padding makes this a fixed size loop
+  size_t group = (base - index->samples) * SAMPLE_STRIDE;
+  const uint64_t *pos = index->pos + group;
+  size_t count = 0;
+  for (size_t i = 1; i < SAMPLE_STRIDE; i++)
+    count += pos[i] <= offset;
+  return group + count;
+}
+
+// resolve block i to where its data lives
+static int get_block(struct target_stream *target, size_t i,
+                     struct segment *block) {
+  const struct block_index *index = &target->index;
+  uint64_t ref = index->ref[i];
+  size_t len = index->pos[i + 1] - index->pos[i];
+
+  if (ref & REF_FILL) {
+    *block = (struct segment){
+        .len = len, .source_offset = SIZE_MAX, .fd = -1, .fill = (uint8_t)ref};
+  } else if (ref & REF_SOURCE) {
+    size_t offset = ref & ~REF_SOURCE;
+    if (offset > target->source_len || len > target->source_len - offset)
+      return -EIO;
+    *block = (struct segment){.data = target->source_data + offset,
+                              .len = len,
+                              .source_offset = offset,
+                              .fd = target->source_fd};
+  } else if (index->data_base) {
+    if (ref > target->data_len || len > target->data_len - ref)
+      return -EIO;
+    *block = (struct segment){.data = index->data_base + ref,
+                              .len = len,
+                              .source_offset = SIZE_MAX,
+                              .fd = -1};
+  } else {
+    *block = (struct segment){.data = (const uint8_t *)(uintptr_t)ref,
+                              .len = len,
+                              .source_offset = SIZE_MAX,
+                              .fd = -1};
+  }
+  return 0;
+}
+
+// called for each consecutive piece of a range, nonzero stops the walk
+typedef int (*walk_fn)(void *ctx, const struct segment *piece);
+
+#define CURSOR_STEPS 16
+
+// like find_block, but walks forward from a hint if offset is shortly after it
+static size_t find_block_from(const struct block_index *index, uint64_t offset,
+                              size_t hint) {
+  if (hint < index->num_blocks && index->pos[hint] <= offset) {
+    size_t end = hint + CURSOR_STEPS;
+    if (end > index->num_blocks)
+      end = index->num_blocks;
+    for (size_t i = hint; i < end; i++)
+      if (offset < index->pos[i + 1])
+        return i;
+  }
+  return find_block(index, offset);
+}
+
+static int walk_blocks(struct target_stream *target, size_t offset, size_t len,
+                       size_t hint, size_t *last, walk_fn fn, void *ctx) {
+  size_t done = 0;
+  for (size_t i = find_block_from(&target->index, offset, hint);
+       i < target->index.num_blocks && done < len; i++) {
+    struct segment block;
+    int rc = get_block(target, i, &block);
+    if (rc < 0)
+      return rc;
+
+    size_t block_offset = offset + done - target->index.pos[i];
+    struct segment piece = block;
+    if (piece.data)
+      piece.data += block_offset;
+    piece.len -= block_offset;
+    if (piece.source_offset != SIZE_MAX)
+      piece.source_offset += block_offset;
+    if (piece.len > len - done)
+      piece.len = len - done;
+
+    rc = fn(ctx, &piece);
+    if (rc < 0)
+      return rc;
+    if (rc > 0)
+      break;
+    done += piece.len;
+    *last = i;
+  }
+  return done;
+}
+
+static int decode_window(struct target_stream *target, struct window *window);
+
+static int in_window(struct window *window, size_t offset) {
+  return window->target_pos <= offset &&
+         offset < window->target_pos + window->target_len;
+}
+
+// windows that are not decoded yet end the walk unless decode is set
+static int walk_windows(struct target_stream *target,
+                        struct read_cursor *cursor, size_t offset, size_t len,
+                        int decode, walk_fn fn, void *ctx) {
+  size_t hint_window = SIZE_MAX;
+  size_t hint_block = SIZE_MAX;
+  if (cursor) {
+    hint_window = atomic_load_explicit(&cursor->window, memory_order_relaxed);
+    hint_block = atomic_load_explicit(&cursor->block, memory_order_relaxed);
+  }
+
+  size_t left;
+  if (hint_window < target->num_windows &&
+      in_window(&target->windows[hint_window], offset)) {
+    left = hint_window;
+  } else if (hint_window + 1 < target->num_windows &&
+             in_window(&target->windows[hint_window + 1], offset)) {
+    left = hint_window + 1;
+    hint_block = 0;
+  } else {
+    // binary search for window containing start of range
+    left = 0;
+    size_t right = target->num_windows;
+    while (left < right) {
+      size_t mid = (left + right) / 2;
+      struct window *window = &target->windows[mid];
+      if (offset < window->target_pos + window->target_len)
+        right = mid;
+      else
+        left = mid + 1;
+    }
+    hint_block = SIZE_MAX;
+  }
+
+  size_t done = 0;
+  size_t last_window = left, last_block = 0;
+  for (; left < target->num_windows && done < len; left++) {
+    struct window *window = &target->windows[left];
+    if (!atomic_load_explicit(&window->decoded, memory_order_acquire)) {
+      if (!decode)
+        break;
+      int rc = decode_window(target, window);
+      if (rc < 0)
+        return rc;
+    }
+
+    size_t window_offset = offset + done - window->target_pos;
+    size_t window_len = window->target_len - window_offset;
+    if (window_len > len - done)
+      window_len = len - done;
+    int rc = walk_blocks(&window->target, window_offset, window_len,
+                         hint_block, &last_block, fn, ctx);
+    if (rc < 0)
+      return rc;
+    last_window = left;
+    // later windows are entered at their start
+    hint_block = 0;
+    done += rc;
+    if ((size_t)rc < window_len)
+      break;
+  }
+
+  if (cursor && done > 0) {
+    atomic_store_explicit(&cursor->window, last_window, memory_order_relaxed);
+    atomic_store_explicit(&cursor->block, last_block, memory_order_relaxed);
+  }
+  return done;
+}
+
+static int walk_index(struct target_stream *target, struct read_cursor *cursor,
+                      size_t offset, size_t len, walk_fn fn, void *ctx) {
+  size_t hint = SIZE_MAX;
+  if (cursor)
+    hint = atomic_load_explicit(&cursor->block, memory_order_relaxed);
+  size_t last = hint;
+  int rc = walk_blocks(target, offset, len, hint, &last, fn, ctx);
+  if (cursor && rc > 0)
+    atomic_store_explicit(&cursor->block, last, memory_order_relaxed);
+  return rc;
+}
+
+// a decoder that failed stays in the way of readers, so reads past what it
+// decoded get its error rather than a short count
+static int decoding(const struct target_stream *target) {
+  return target->decoder &&
+         (!atomic_load_explicit(&target->decoder->done, memory_order_acquire) ||
+          target->decoder->error < 0);
+}
+
+// waits until the index covers the range, the part of it that was decoded
+// before an error can still be read
+static int walk_decoding(struct target_stream *target,
+                         struct read_cursor *cursor, size_t offset,
+                         size_t len, walk_fn fn, void *ctx) {
+  struct decoder *decoder = target->decoder;
+  pthread_mutex_lock(&decoder->lock);
+  while (decoder->decoded < offset + len &&
+         !atomic_load_explicit(&decoder->done, memory_order_relaxed))
+    pthread_cond_wait(&decoder->progress, &decoder->lock);
+  int rc = decoder->decoded < offset + len ? decoder->error : 0;
+  pthread_mutex_unlock(&decoder->lock);
+  if (rc < 0)
+    return rc;
+
+  pthread_rwlock_rdlock(&decoder->index_lock);
+  rc = walk_index(target, cursor, offset, len, fn, ctx);
+  pthread_rwlock_unlock(&decoder->index_lock);
+  return rc;
+}
+
+static int walk_range(struct target_stream *target, struct read_cursor *cursor,
+                      size_t offset, size_t len, walk_fn fn, void *ctx) {
+  int rc;
+  if (target->windows)
+    rc = walk_windows(target, cursor, offset, len, 1, fn, ctx);
+  else if (decoding(target))
+    rc = walk_decoding(target, cursor, offset, len, fn, ctx);
+  else if (target->index.pos == NULL)
+    return 0;
+  else
+    rc = walk_index(target, cursor, offset, len, fn, ctx);
+  if (cursor && rc > 0)
+    atomic_store_explicit(&cursor->next, offset + rc, memory_order_relaxed);
+  return rc;
+}
+
+#define PREFETCH_MIN (128 * 1024)
+#define PREFETCH_MAX (8 * 1024 * 1024)
+// source ranges closer than this are prefetched together
+#define PREFETCH_GAP (64 * 1024)
+
+// the source range pending a prefetch
+struct prefetch {
+  const uint8_t *source;
+  size_t start;
+  size_t end;
+};
+
+static void flush_prefetch(struct prefetch *prefetch) {
+  if (prefetch->end == prefetch->start)
+    return;
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)(prefetch->source + prefetch->start);
+  uintptr_t end = (uintptr_t)(prefetch->source + prefetch->end);
+  start &= ~(page - 1);
+  madvise((void *)start, end - start, MADV_WILLNEED);
+  prefetch->start = prefetch->end;
+}
+
+static int prefetch_piece(void *ctx, const struct segment *piece) {
+  struct prefetch *prefetch = ctx;
+  if (piece->source_offset == SIZE_MAX)
+    return 0;
+
+  size_t start = piece->source_offset;
+  size_t end = start + piece->len;
+  if (prefetch->end > prefetch->start && start >= prefetch->start &&
+      start <= prefetch->end + PREFETCH_GAP) {
+    if (end > prefetch->end)
+      prefetch->end = end;
+    return 0;
+  }
+  flush_prefetch(prefetch);
+  prefetch->start = start;
+  prefetch->end = end;
+  return 0;
+}
+
+// asks the kernel to read the parts of the source behind a target range in
+// the background, only windows that are already decoded are looked at
+static void prefetch_range(struct target_stream *target, size_t hint,
+                           size_t offset, size_t len) {
+  struct prefetch prefetch = {.source = target->source_data};
+  if (target->windows) {
+    walk_windows(target, NULL, offset, len, 0, prefetch_piece, &prefetch);
+  } else if (target->index.pos) {
+    size_t last;
+    walk_blocks(target, offset, len, hint, &last, prefetch_piece, &prefetch);
+  }
+  flush_prefetch(&prefetch);
+}
+
+// sequential readers get source data ahead of them prefetched in a window
+// that doubles with every sequential read, large random reads get their own
+// range prefetched so its page faults are served in parallel
+static void prefetch(struct target_stream *target, struct read_cursor *cursor,
+                     size_t offset, size_t len) {
+  // the index cannot be walked ahead of readers while it is being built
+  if (cursor == NULL || target->source_data == NULL || decoding(target))
+    return;
+
+  size_t end = offset + len;
+  if (offset != atomic_load_explicit(&cursor->next, memory_order_relaxed)) {
+    atomic_store_explicit(&cursor->streak, 0, memory_order_relaxed);
+    atomic_store_explicit(&cursor->ahead, end, memory_order_relaxed);
+    if (len >= PREFETCH_MIN)
+      prefetch_range(target, SIZE_MAX, offset, len);
+    return;
+  }
+
+  unsigned streak = atomic_load_explicit(&cursor->streak, memory_order_relaxed);
+  size_t window = PREFETCH_MAX;
+  if (streak < 16 && (PREFETCH_MIN << streak) < PREFETCH_MAX) {
+    window = PREFETCH_MIN << streak;
+    atomic_store_explicit(&cursor->streak, streak + 1, memory_order_relaxed);
+  }
+
+  // like kernel readahead, the next batch is issued once half of the
+  // previous one was consumed
+  size_t ahead = atomic_load_explicit(&cursor->ahead, memory_order_relaxed);
+  if (ahead < offset)
+    ahead = offset;
+  if (ahead >= end + window / 2)
+    return;
+  atomic_store_explicit(&cursor->ahead, end + window, memory_order_relaxed);
+  size_t hint = atomic_load_explicit(&cursor->block, memory_order_relaxed);
+  prefetch_range(target, hint, ahead, end + window - ahead);
+}
+
+static int copy_piece(void *ctx, const struct segment *piece) {
+  uint8_t **dest = ctx;
+  if (piece->data)
+    memcpy(*dest, piece->data, piece->len);
+  else
+    memset(*dest, piece->fill, piece->len);
+  *dest += piece->len;
+  return 0;
+}
+
+int read_range_cursor(struct target_stream target[static 1],
+                      struct read_cursor *cursor, size_t offset, size_t len,
+                      uint8_t dest[static len]) {
+  prefetch(target, cursor, offset, len);
+  return walk_range(target, cursor, offset, len, copy_piece, &dest);
+}
+
 int read_range(struct target_stream target[static 1], size_t offset, size_t len,
                uint8_t dest[static len]) {
-  // binary search for block containing start of range
-  size_t left = 0;
-  size_t right = target->num_blocks;
-  while (left < right) {
-    size_t mid = (left + right) / 2;
-    if (offset < target->blocks[mid].pos + target->blocks[mid].size)
-      right = mid;
-    else
-      left = mid + 1;
-  }
-  if (left == target->num_blocks)
-    return 0;
+  return read_range_cursor(target, NULL, offset, len, dest);
+}
+
+struct segment_list {
+  struct segment *segments;
+  size_t num_segments;
+  size_t max_segments;
+};
+
+static int add_segment(void *ctx, const struct segment *piece) {
+  struct segment_list *list = ctx;
 
-  // copy data from first block until end of range
-  struct block *block = &target->blocks[left];
-  size_t block_offset = offset - block->pos;
-  size_t block_len = block->size - block_offset;
-  if (block_len > len)
-    block_len = len;
-  memcpy(dest, block->data + block_offset, block_len);
-
-  // copy data from remaining blocks
-  size_t remaining = len - block_len;
-  while (remaining > 0) {
-    block = &target->blocks[++left];
-    if (left >= target->num_blocks)
-      return len - remaining;
-    block_len = block->size;
-    if (block_len > remaining)
-      block_len = remaining;
-    memcpy(dest + len - remaining, block->data, block_len);
-    remaining -= block_len;
-  }
-  return len;
+  // extend the previous segment if the data or fill continues it
+  if (list->num_segments > 0) {
+    struct segment *last = &list->segments[list->num_segments - 1];
+    int continues = piece->data ? last->data &&
+                                      last->data + last->len == piece->data &&
+                                      (last->source_offset == SIZE_MAX) ==
+                                          (piece->source_offset == SIZE_MAX)
+                                : !last->data && last->fill == piece->fill;
+    if (continues) {
+      last->len += piece->len;
+      return 0;
+    }
+  }
+
+  if (list->num_segments == list->max_segments)
+    return 1;
+  list->segments[list->num_segments++] = *piece;
+  return 0;
 }
 
-int load_diff(struct target_stream target[static 1],
-              struct source_stream source[static 1], int fd_source,
-              int fd_delta) {
-  // mmap source file
-  struct stat stat_source;
-  if (fstat(fd_source, &stat_source) < 0)
-    return -errno;
+int map_range_cursor(struct target_stream target[static 1],
+                     struct read_cursor *cursor, size_t offset, size_t len,
+                     struct segment *segments, size_t max_segments) {
+  struct segment_list list = {.segments = segments,
+                              .max_segments = max_segments};
+  prefetch(target, cursor, offset, len);
+  int rc = walk_range(target, cursor, offset, len, add_segment, &list);
+  if (rc < 0)
+    return rc;
+  return list.num_segments;
+}
 
-  // init source stream
-  *source =
-      (struct source_stream){.len = stat_source.st_size,
-                             .data = mmap(NULL, stat_source.st_size, PROT_READ,
-                                          MAP_PRIVATE, fd_source, 0),
-                             .target = target};
+int map_range(struct target_stream target[static 1], size_t offset, size_t len,
+              struct segment *segments, size_t max_segments) {
+  return map_range_cursor(target, NULL, offset, len, segments, max_segments);
+}
 
-  if (source->data == MAP_FAILED)
-    return -errno;
+static int decode_parallel(struct target_stream *target,
+                           struct source_stream *source);
 
+// decodes the delta into the index of target, source is the mapped base or
+// the target of the delta below in a chain
+static int decode_diff(struct target_stream *target,
+                       struct source_stream *source, int fd_delta) {
   // init target stream
-  *target = (struct target_stream){.capacity = 16,
-                                   .blocks = malloc(16 * sizeof(struct block))};
+  *target = (struct target_stream){.source_data = source->data,
+                                   .source_len = source->len,
+                                   .source_fd = source->fd};
 
-  if (target->blocks == NULL)
+  if (index_init(&target->index) < 0)
     return -ENOMEM;
 
   vcdiff_t ctx;
@@ -164,20 +763,602 @@ int load_diff(struct target_stream target[static 1],
   vcdiff_set_source_driver(&ctx, &source_driver, source);
   vcdiff_set_target_driver(&ctx, &target_driver, target);
 
-  int rc = 0;
-  uint8_t delta_buf[16 * 1024];
-  size_t delta_len;
-  while ((delta_len = read(fd_delta, delta_buf, sizeof(delta_buf))) > 0) {
-    rc = vcdiff_apply_delta(&ctx, delta_buf, delta_len);
+  // map the delta if possible so add blocks can point into the page cache
+  struct stat stat_delta;
+  if (fstat(fd_delta, &stat_delta) == 0 && S_ISREG(stat_delta.st_mode) &&
+      stat_delta.st_size > 0) {
+    uint8_t *delta_map = mmap(NULL, stat_delta.st_size, PROT_READ,
+                              MAP_SHARED, fd_delta, 0);
+    if (delta_map != MAP_FAILED) {
+      target->delta_map = delta_map;
+      target->delta_len = stat_delta.st_size;
+    }
+  }
+
+  int rc, parallel = 0;
+  if (target->delta_map) {
+    madvise(target->delta_map, target->delta_len, MADV_SEQUENTIAL);
+    rc = decode_parallel(target, source);
+    if (rc < 0 && rc != -ENOTSUP)
+      return rc;
+    parallel = rc == 0;
+    if (!parallel) {
+      rc = vcdiff_apply_delta(&ctx, target->delta_map, target->delta_len);
+      if (rc < 0)
+        goto exit;
+    }
+  } else {
+    uint8_t delta_buf[16 * 1024];
+    ssize_t delta_len;
+    while ((delta_len = read(fd_delta, delta_buf, sizeof(delta_buf))) > 0) {
+      rc = vcdiff_apply_delta(&ctx, delta_buf, delta_len);
+      if (rc < 0)
+        goto exit;
+    }
+    if (delta_len < 0)
+      return -errno;
+  }
+
+  if (!parallel) {
+    rc = vcdiff_finish(&ctx);
     if (rc < 0)
       goto exit;
   }
 
-  rc = vcdiff_finish(&ctx);
+  if (target->delta_map) {
+    if (target->mapped_len == 0) {
+      // the decoder copied everything, the mapping is not needed
+      munmap(target->delta_map, target->delta_len);
+      target->delta_map = NULL;
+    } else {
+      madvise(target->delta_map, target->delta_len, MADV_RANDOM);
+    }
+  }
+  return index_finish(&target->index);
 
 exit:
+  fprintf(stderr, "Error while applying delta: %s\n", vcdiff_error_str(&ctx));
+
+  return rc;
+}
+
+int load_diff(struct target_stream target[static 1],
+              struct source_stream source[static 1], int fd_source,
+              int fd_delta) {
+  // init source stream
+  *source = (struct source_stream){.target = target};
+  int rc = map_source(source, fd_source);
+  if (rc < 0)
+    return rc;
+  return decode_diff(target, source, fd_delta);
+}
+
+// where the pieces of the target below are appended to a flattened index
+struct flatten {
+  struct block_index *index;
+  size_t pos;
+};
+
+static int flatten_piece(void *ctx, const struct segment *piece) {
+  struct flatten *flatten = ctx;
+  uint64_t ref;
+  if (piece->source_offset != SIZE_MAX)
+    ref = REF_SOURCE | piece->source_offset;
+  else if (piece->data)
+    ref = (uintptr_t)piece->data;
+  else
+    ref = REF_FILL | piece->fill;
+  int rc = push_block(flatten->index, flatten->pos, piece->len, ref);
+  flatten->pos += piece->len;
+  return rc;
+}
+
+#define FLATTEN_STEP (1 << 30)
+
+// replaces the source blocks of target, which are offsets into the target of
+// lower, by the blocks of lower they cover, so reads never go through lower
+static int flatten_blocks(struct target_stream *target,
+                          struct target_stream *lower) {
+  struct block_index index;
+  int rc = index_init(&index);
+  if (rc < 0)
+    return rc;
+
+  const struct block_index *upper = &target->index;
+  struct flatten flatten = {.index = &index};
+  size_t hint = SIZE_MAX;
+  for (size_t i = 0; i < upper->num_blocks && rc >= 0; i++) {
+    uint64_t ref = upper->ref[i];
+    size_t len = upper->pos[i + 1] - upper->pos[i];
+    flatten.pos = upper->pos[i];
+    if (ref & REF_SOURCE) {
+      // walks count their bytes in an int, merged copies can be far longer
+      for (size_t done = 0; done < len && rc >= 0;) {
+        size_t step = len - done < FLATTEN_STEP ? len - done : FLATTEN_STEP;
+        rc = walk_blocks(lower, (ref & ~REF_SOURCE) + done, step, hint, &hint,
+                         flatten_piece, &flatten);
+        // copies past the end of the target below are a corrupt delta
+        if (rc >= 0 && (size_t)rc < step)
+          rc = -EIO;
+        done += step;
+      }
+    } else {
+      rc = push_block(&index, flatten.pos, len, ref);
+    }
+  }
+  if (rc >= 0)
+    rc = index_finish(&index);
+  if (rc < 0) {
+    index_free(&index);
+    return rc;
+  }
+
+  index_free(&target->index);
+  target->index = index;
+  target->source_data = lower->source_data;
+  target->source_len = lower->source_len;
+  target->source_fd = lower->source_fd;
+  // only the data of lower is still referenced
+  index_free(&lower->index);
+  return 0;
+}
+
+int load_diff_chain(struct target_stream target[static 1],
+                    struct source_stream source[static 1], int fd_source,
+                    size_t num_deltas, const int fd_deltas[static num_deltas]) {
+  if (num_deltas == 0)
+    return -EINVAL;
+  if (num_deltas > MAX_DIFF_CHAIN)
+    return -ELOOP;
+
+  int rc = load_diff(target, source, fd_source, fd_deltas[0]);
+  for (size_t i = 1; i < num_deltas && rc >= 0; i++) {
+    struct target_stream *lower = malloc(sizeof(struct target_stream));
+    if (lower == NULL) {
+      rc = -ENOMEM;
+      break;
+    }
+    *lower = *target;
+
+    // the delta is decoded against the target below it, its source blocks
+    // are offsets into that target until they are flattened
+    struct source_stream lower_source = {
+        .len = lower->offset, .fd = -1, .target = target};
+    rc = decode_diff(target, &lower_source, fd_deltas[i]);
+    target->lower = lower;
+    if (rc >= 0)
+      rc = flatten_blocks(target, lower);
+  }
+  return rc;
+}
+
+// delta bytes decoded at once, readers get at the index in between
+#define DECODE_SLICE (256 * 1024)
+
+static void publish_progress(struct decoder *decoder, size_t decoded,
+                             int error, int done) {
+  pthread_mutex_lock(&decoder->lock);
+  decoder->decoded = decoded;
+  decoder->error = error;
+  if (done)
+    atomic_store_explicit(&decoder->done, 1, memory_order_release);
+  pthread_cond_broadcast(&decoder->progress);
+  pthread_mutex_unlock(&decoder->lock);
+}
+
+static void *decode_background(void *arg) {
+  struct target_stream *target = arg;
+  struct decoder *decoder = target->decoder;
+
+  int rc = 0;
+  for (size_t pos = 0; pos < target->delta_len && rc >= 0;) {
+    if (atomic_load_explicit(&decoder->cancel, memory_order_relaxed)) {
+      rc = -ECANCELED;
+      break;
+    }
+    size_t len = target->delta_len - pos;
+    if (len > DECODE_SLICE)
+      len = DECODE_SLICE;
+    pthread_rwlock_wrlock(&decoder->index_lock);
+    rc = vcdiff_apply_delta(&decoder->ctx, target->delta_map + pos, len);
+    size_t decoded = target->offset;
+    pthread_rwlock_unlock(&decoder->index_lock);
+    pos += len;
+    publish_progress(decoder, decoded, 0, 0);
+  }
+
+  pthread_rwlock_wrlock(&decoder->index_lock);
+  if (rc >= 0)
+    rc = vcdiff_finish(&decoder->ctx);
+  if (rc < 0 && rc != -ECANCELED)
+    fprintf(stderr, "Error while applying delta: %s\n",
+            vcdiff_error_str(&decoder->ctx));
+  if (rc >= 0) {
+    // the decoder copied everything, the mapping is not needed
+    if (target->mapped_len == 0) {
+      munmap(target->delta_map, target->delta_len);
+      target->delta_map = NULL;
+    } else {
+      madvise(target->delta_map, target->delta_len, MADV_RANDOM);
+    }
+    rc = index_finish(&target->index);
+  }
+  size_t decoded = target->offset;
+  pthread_rwlock_unlock(&decoder->index_lock);
+
+  publish_progress(decoder, decoded, rc < 0 ? -EIO : 0, 1);
+  return NULL;
+}
+
+int load_diff_background(struct target_stream target[static 1],
+                         struct source_stream source[static 1], int fd_source,
+                         int fd_delta) {
+  // the delta is decoded from a mapping, so it has to be a regular file
+  struct stat stat_delta;
+  if (fstat(fd_delta, &stat_delta) < 0)
+    return -errno;
+  if (!S_ISREG(stat_delta.st_mode) || stat_delta.st_size == 0)
+    return -ENOTSUP;
+
+  *source = (struct source_stream){.target = target};
+  int rc = map_source(source, fd_source);
+  if (rc < 0)
+    return rc;
+
+  *target = (struct target_stream){
+      .source_data = source->data,
+      .source_len = source->len,
+      .source_fd = source->fd,
+      .delta_len = stat_delta.st_size,
+      .delta_map = mmap(NULL, stat_delta.st_size, PROT_READ, MAP_SHARED,
+                        fd_delta, 0)};
+  if (target->delta_map == MAP_FAILED) {
+    rc = -errno;
+    goto unmap_source;
+  }
+
+  // only the magic is checked up front, errors after it fail the reads
+  const uint8_t *data = target->delta_map;
+  if (target->delta_len < 5 || data[0] != 0xd6 || data[1] != 0xc3 ||
+      data[2] != 0xc4) {
+    rc = -EINVAL;
+    goto unmap_delta;
+  }
+
+  struct decoder *decoder = calloc(1, sizeof(struct decoder));
+  if (decoder == NULL || index_init(&target->index) < 0) {
+    free(decoder);
+    rc = -ENOMEM;
+    goto free_index;
+  }
+  vcdiff_init(&decoder->ctx);
+  vcdiff_set_source_driver(&decoder->ctx, &source_driver, source);
+  vcdiff_set_target_driver(&decoder->ctx, &target_driver, target);
+
+  // readers get in between slices instead of starving the decoder
+  pthread_rwlockattr_t attr;
+  pthread_rwlockattr_init(&attr);
+  pthread_rwlockattr_setkind_np(&attr,
+                                PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+  pthread_rwlock_init(&decoder->index_lock, &attr);
+  pthread_rwlockattr_destroy(&attr);
+  pthread_mutex_init(&decoder->lock, NULL);
+  pthread_cond_init(&decoder->progress, NULL);
+
+  madvise(target->delta_map, target->delta_len, MADV_SEQUENTIAL);
+  target->decoder = decoder;
+  rc = pthread_create(&decoder->thread, NULL, decode_background, target);
+  if (rc != 0) {
+    target->decoder = NULL;
+    pthread_rwlock_destroy(&decoder->index_lock);
+    pthread_mutex_destroy(&decoder->lock);
+    pthread_cond_destroy(&decoder->progress);
+    free(decoder);
+    rc = -rc;
+    goto free_index;
+  }
+  return 0;
+
+  // leave nothing behind so the caller can fall back to load_diff
+free_index:
+  index_free(&target->index);
+unmap_delta:
+  munmap(target->delta_map, target->delta_len);
+unmap_source:
+  unmap_source(source);
+  *target = (struct target_stream){0};
+  return rc;
+}
+
+#define VCD_DECOMPRESS 0x01
+#define VCD_CODETABLE 0x02
+#define VCD_APPHEADER 0x04
+
+#define VCD_SOURCE 0x01
+#define VCD_TARGET 0x02
+
+static int read_varint(const uint8_t *data, size_t len, size_t *pos,
+                       size_t *value) {
+  *value = 0;
+  for (int i = 0; i < 10; i++) {
+    if (*pos >= len)
+      return -EINVAL;
+    uint8_t byte = data[(*pos)++];
+    *value = (*value << 7) | (byte & 0x7f);
+    if (!(byte & 0x80))
+      return 0;
+  }
+  return -EINVAL;
+}
+
+static int append_window(struct target_stream *target, size_t *capacity,
+                         struct window window) {
+  if (target->num_windows == *capacity) {
+    *capacity = *capacity ? *capacity * 2 : 16;
+    struct window *windows =
+        realloc(target->windows, *capacity * sizeof(struct window));
+    if (windows == NULL)
+      return -ENOMEM;
+    target->windows = windows;
+  }
+  target->windows[target->num_windows++] = window;
+  return 0;
+}
+
+// find window boundaries without decoding any instructions
+static int scan_windows(struct target_stream *target) {
+  const uint8_t *data = target->delta_map;
+  size_t len = target->delta_len;
+
+  if (len < 5 || data[0] != 0xd6 || data[1] != 0xc3 || data[2] != 0xc4)
+    return -EINVAL;
+  uint8_t hdr_indicator = data[4];
+  size_t pos = 5;
+  // secondary compression spans windows, so they cannot be decoded alone
+  if (hdr_indicator & VCD_DECOMPRESS)
+    return -ENOTSUP;
+  for (uint8_t flag = VCD_CODETABLE; flag <= VCD_APPHEADER; flag <<= 1) {
+    if (!(hdr_indicator & flag))
+      continue;
+    size_t skip;
+    if (read_varint(data, len, &pos, &skip) < 0 || skip > len - pos)
+      return -EINVAL;
+    pos += skip;
+  }
+  target->header_len = pos;
+
+  size_t capacity = 0;
+  size_t target_pos = 0;
+  while (pos < len) {
+    size_t window_pos = pos;
+    uint8_t win_indicator = data[pos++];
+    // windows copying from earlier target data depend on their predecessors
+    if (win_indicator & VCD_TARGET)
+      return -ENOTSUP;
+
+    size_t value;
+    if (win_indicator & VCD_SOURCE)
+      for (int i = 0; i < 2; i++)
+        if (read_varint(data, len, &pos, &value) < 0)
+          return -EINVAL;
+
+    size_t encoding_len, target_len;
+    if (read_varint(data, len, &pos, &encoding_len) < 0 ||
+        encoding_len > len - pos)
+      return -EINVAL;
+    size_t encoding_pos = pos;
+    if (read_varint(data, len, &pos, &target_len) < 0)
+      return -EINVAL;
+
+    int rc = append_window(target, &capacity,
+                           (struct window){.target_pos = target_pos,
+                                           .target_len = target_len,
+                                           .delta_pos = window_pos,
+                                           .delta_len = encoding_pos +
+                                                        encoding_len -
+                                                        window_pos});
+    if (rc < 0)
+      return rc;
+    target_pos += target_len;
+    pos = encoding_pos + encoding_len;
+  }
+  target->offset = target_pos;
+  return 0;
+}
+
+// decodes a window into its own blocks, windows do not share any state
+static int decode_blocks(struct target_stream *target,
+                         const struct source_stream *source_stream,
+                         struct window *window) {
+  struct target_stream *blocks = &window->target;
+  *blocks = (struct target_stream){.source_data = target->source_data,
+                                   .source_len = target->source_len,
+                                   .source_fd = target->source_fd,
+                                   .delta_map = target->delta_map,
+                                   .delta_len = target->delta_len};
+  int rc = index_init(&blocks->index);
+  if (rc < 0)
+    return rc;
+
+  // the source driver hands out pointers through the window's own stream
+  struct source_stream source = *source_stream;
+  source.target = blocks;
+
+  vcdiff_t ctx;
+  vcdiff_init(&ctx);
+  vcdiff_set_source_driver(&ctx, &source_driver, &source);
+  vcdiff_set_target_driver(&ctx, &target_driver, blocks);
+
+  // replay the file header, then just this window
+  rc = vcdiff_apply_delta(&ctx, target->delta_map, target->header_len);
+  if (rc >= 0)
+    rc = vcdiff_apply_delta(&ctx, target->delta_map + window->delta_pos,
+                            window->delta_len);
+  if (rc >= 0)
+    rc = vcdiff_finish(&ctx);
+
+  if (rc >= 0 && blocks->offset != window->target_len)
+    rc = -EINVAL;
+  if (rc >= 0)
+    rc = index_finish(&blocks->index);
+  if (rc < 0) {
+    fprintf(stderr, "Error while applying delta window: %s\n",
+            vcdiff_error_str(&ctx));
+    free_blocks(blocks);
+    *blocks = (struct target_stream){0};
+    return -EIO;
+  }
+  return 0;
+}
+
+static int decode_window(struct target_stream *target, struct window *window) {
+  int rc = 0;
+  pthread_mutex_lock(&target->lock);
+  if (!atomic_load_explicit(&window->decoded, memory_order_relaxed)) {
+    rc = decode_blocks(target, target->source, window);
+    if (rc >= 0)
+      atomic_store_explicit(&window->decoded, 1, memory_order_release);
+  }
+  pthread_mutex_unlock(&target->lock);
+  return rc;
+}
+
+#define MAX_DECODE_THREADS 16
+// below this many windows a single thread decodes the delta
+#define MIN_PARALLEL_WINDOWS 4
+
+// windows are handed out to the decoding threads in order
+struct window_queue {
+  struct target_stream *target;
+  const struct source_stream *source;
+  atomic_size_t next;
+  atomic_int error;
+};
+
+static void *decode_queue(void *arg) {
+  struct window_queue *queue = arg;
+  struct target_stream *target = queue->target;
+  for (;;) {
+    size_t i = atomic_fetch_add_explicit(&queue->next, 1, memory_order_relaxed);
+    if (i >= target->num_windows ||
+        atomic_load_explicit(&queue->error, memory_order_relaxed))
+      break;
+    int rc = decode_blocks(target, queue->source, &target->windows[i]);
+    if (rc < 0) {
+      atomic_store_explicit(&queue->error, rc, memory_order_relaxed);
+      break;
+    }
+  }
+  return NULL;
+}
+
+static void free_windows(struct target_stream *target) {
+  for (size_t i = 0; i < target->num_windows; i++)
+    free_blocks(&target->windows[i].target);
+  free(target->windows);
+  target->windows = NULL;
+  target->num_windows = 0;
+}
+
+// moves the blocks of the decoded windows into the index of target
+static int join_windows(struct target_stream *target) {
+  struct block_index *index = &target->index;
+  for (size_t i = 0; i < target->num_windows; i++) {
+    struct window *window = &target->windows[i];
+    struct target_stream *blocks = &window->target;
+    const struct block_index *window_index = &blocks->index;
+    for (size_t j = 0; j < window_index->num_blocks; j++) {
+      size_t pos = window_index->pos[j];
+      int rc = push_block(index, window->target_pos + pos,
+                          window_index->pos[j + 1] - pos,
+                          window_index->ref[j]);
+      if (rc < 0)
+        return rc;
+    }
+    arena_join(&target->arena, &blocks->arena);
+    target->data_len += blocks->data_len;
+    target->mapped_len += blocks->mapped_len;
+  }
+  return 0;
+}
+
+// deltas whose windows only copy from the source are decoded window by
+// window on all cores, -ENOTSUP if it has to be decoded in one pass
+static int decode_parallel(struct target_stream *target,
+                           struct source_stream *source) {
+  int rc = scan_windows(target);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (rc < 0 || target->num_windows < MIN_PARALLEL_WINDOWS || cpus < 2) {
+    // malformed deltas are left to the decoder to report
+    free_windows(target);
+    target->offset = 0;
+    target->header_len = 0;
+    return -ENOTSUP;
+  }
+
+  size_t num_threads = cpus;
+  if (num_threads > MAX_DECODE_THREADS)
+    num_threads = MAX_DECODE_THREADS;
+  if (num_threads > target->num_windows)
+    num_threads = target->num_windows;
+
+  struct window_queue queue = {.target = target, .source = source};
+  pthread_t threads[MAX_DECODE_THREADS];
+  size_t started = 0;
+  // this thread decodes as well, failing to start more only costs speed
+  while (started + 1 < num_threads &&
+         pthread_create(&threads[started], NULL, decode_queue, &queue) == 0)
+    started++;
+  decode_queue(&queue);
+  for (size_t i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  rc = atomic_load_explicit(&queue.error, memory_order_relaxed);
+  if (rc >= 0)
+    rc = join_windows(target);
+  free_windows(target);
+  target->header_len = 0;
+  return rc;
+}
+
+int load_diff_lazy(struct target_stream target[static 1],
+                   struct source_stream source[static 1], int fd_source,
+                   int fd_delta) {
+  struct stat stat_delta;
+  if (fstat(fd_delta, &stat_delta) < 0)
+    return -errno;
+
+  *source = (struct source_stream){.target = target};
+  int rc = map_source(source, fd_source);
   if (rc < 0)
-    fprintf(stderr, "Error while applying delta: %s\n", vcdiff_error_str(&ctx));
+    return rc;
+
+  // the delta stays mapped, windows are decoded from it on demand
+  *target = (struct target_stream){
+      .source = source,
+      .source_data = source->data,
+      .source_len = source->len,
+      .source_fd = source->fd,
+      .delta_len = stat_delta.st_size,
+      .delta_map = mmap(NULL, stat_delta.st_size, PROT_READ, MAP_SHARED,
+                        fd_delta, 0)};
+  if (target->delta_map == MAP_FAILED) {
+    rc = -errno;
+    goto unmap_source;
+  }
+
+  rc = scan_windows(target);
+  if (rc < 0)
+    goto unmap_delta;
+  pthread_mutex_init(&target->lock, NULL);
+  return 0;
 
+  // leave nothing behind so the caller can fall back to load_diff
+unmap_delta:
+  free(target->windows);
+  munmap(target->delta_map, target->delta_len);
+unmap_source:
+  unmap_source(source);
+  *target = (struct target_stream){0};
   return rc;
 }
@@ -1,36 +1,212 @@
 #ifndef VCDIFF_INCREMENTAL_H
 #define VCDIFF_INCREMENTAL_H
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdint.h>
 
-struct block {
-  size_t pos;
+#define INDEX_MAGIC "VCDIDX03"
+
+// on-disk layout of a precompiled block index, in host byte order, the
+// arrays are copies of a finished struct block_index
+struct index_header {
+  char magic[8];
+  uint64_t delta_size;
+  int64_t delta_mtime_sec, delta_mtime_nsec;
+  uint64_t source_size;
+  int64_t source_mtime_sec, source_mtime_nsec;
+  uint64_t target_size;
+  uint64_t num_blocks;
+  uint64_t num_samples;
+  uint64_t pos_offset;
+  uint64_t ref_offset;
+  uint64_t samples_offset;
+  uint64_t data_offset;
+  uint64_t data_len;
+};
+
+// bump allocator for block data, freed all at once
+struct arena {
+  struct slab *slabs;
+  uint8_t *pos;
+  uint8_t *end;
+  size_t slab_size;
   size_t size;
-  uint8_t *data;
+};
+
+#define SAMPLE_STRIDE 16
+
+// source blocks store their offset into the source with this bit set, fill
+// blocks their byte with REF_FILL set, others point at their data, or are
+// offsets from data_base if that is set
+#define REF_SOURCE (UINT64_C(1) << 63)
+#define REF_FILL (UINT64_C(1) << 62)
+
+// blocks in target order, sizes are implicit in the next position, pos
+// holds num_blocks + 1 entries padded with UINT64_MAX to whole groups
+struct block_index {
+  uint64_t *pos;
+  uint64_t *ref;
+  // every SAMPLE_STRIDE-th position, built once the index is complete
+  uint64_t *samples;
+  size_t num_samples;
+  size_t num_blocks;
+  size_t capacity;
+  const uint8_t *data_base;
 };
 
 struct target_stream {
   int source_flag;
   size_t offset;
-  struct block *blocks;
-  size_t num_blocks;
-  size_t capacity;
+  struct block_index index;
+  size_t data_len;
+  struct arena arena;
+  // add data referenced in the mapped delta instead of copied
+  size_t mapped_len;
+  const uint8_t *source_data;
+  size_t source_len;
+  int source_fd;
+  // set when the index is mapped from an index file
+  uint8_t *index_map;
+  size_t index_len;
+  // the delta, if it could be mapped
+  uint8_t *delta_map;
+  size_t delta_len;
+  // set instead of the index for lazily decoded deltas
+  struct window *windows;
+  size_t num_windows;
+  struct source_stream *source;
+  size_t header_len;
+  pthread_mutex_t lock;
+  // set for deltas decoded in the background by load_diff_background
+  struct decoder *decoder;
+  // the target below a flattened chain, data blocks may point into it
+  struct target_stream *lower;
+};
+
+// a VCDIFF window, its blocks are decoded on first access
+struct window {
+  size_t target_pos;
+  size_t target_len;
+  size_t delta_pos;
+  size_t delta_len;
+  atomic_int decoded;
+  struct target_stream target;
 };
 
 struct source_stream {
   size_t len;
   uint8_t *data;
+  // a descriptor of the mapped file, owned by the mapping
+  int fd;
   struct target_stream *target;
+  struct source_map *map;
 };
 
+#define SOURCE_MAP_POPULATE 0x1
+#define SOURCE_MAP_HUGEPAGE 0x2
+
+// base files are mapped once and shared by all source streams over them,
+// flags apply to files mapped afterwards
+void set_source_map_flags(int flags);
+
+int map_source(struct source_stream source[static 1], int fd_source);
+
+int unmap_source(struct source_stream source[static 1]);
+
 int free_data(struct target_stream target[static 1],
               struct source_stream source[static 1]);
 
+// a piece of a target range, either in the source, in memory or a fill,
+// source pieces can be read through data or from fd at source_offset
+struct segment {
+  // NULL for a fill of len times the fill byte
+  const uint8_t *data;
+  size_t len;
+  // offset into the source, SIZE_MAX if not backed by it
+  size_t source_offset;
+  // the source file, -1 if not backed by it, valid until free_data
+  int fd;
+  uint8_t fill;
+};
+
+// where a reader's last read ended, sequential reads continue from here
+// instead of searching, stale or racing values only cost a full search
+struct read_cursor {
+  atomic_size_t window;
+  atomic_size_t block;
+  // target offset the next read starts at if the reader is sequential
+  atomic_size_t next;
+  // base ranges of target bytes up to here were already prefetched
+  atomic_size_t ahead;
+  // consecutive sequential reads, the prefetch window grows with it
+  atomic_uint streak;
+};
+
+size_t memory_usage(struct target_stream target[static 1]);
+
 int read_range(struct target_stream target[static 1], size_t offset, size_t len,
                uint8_t dest[static len]);
 
+int read_range_cursor(struct target_stream target[static 1],
+                      struct read_cursor *cursor, size_t offset, size_t len,
+                      uint8_t dest[static len]);
+
+int map_range(struct target_stream target[static 1], size_t offset, size_t len,
+              struct segment *segments, size_t max_segments);
+
+int map_range_cursor(struct target_stream target[static 1],
+                     struct read_cursor *cursor, size_t offset, size_t len,
+                     struct segment *segments, size_t max_segments);
+
+// reads the source parts of target ranges with io_uring in one batch instead
+// of faulting them in from the mapping, a reader must not be shared between
+// threads, with direct reads go through an aligned bounce buffer so the
+// source descriptor may be opened with O_DIRECT
+struct source_reader;
+
+int source_reader_new(struct source_reader **reader, unsigned depth,
+                      int direct);
+
+void source_reader_free(struct source_reader *reader);
+
+// falls back to read_range_cursor without io_uring support or once the ring of
+// the reader could not be set up again after a failed batch
+int read_range_reader(struct target_stream target[static 1],
+                      struct read_cursor *cursor,
+                      struct source_reader *reader, int fd_source,
+                      size_t offset, size_t len, uint8_t dest[static len]);
+
 int load_diff(struct target_stream target[static 1],
               struct source_stream source[static 1], int fd_source,
               int fd_delta);
+
+int load_diff_lazy(struct target_stream target[static 1],
+                   struct source_stream source[static 1], int fd_source,
+                   int fd_delta);
+
+// returns once the delta header is checked and decodes the rest in a thread,
+// reads wait until the index covers their range, target and source must
+// stay in place until free_data
+int load_diff_background(struct target_stream target[static 1],
+                         struct source_stream source[static 1], int fd_source,
+                         int fd_delta);
+
+#define MAX_DIFF_CHAIN 16
+
+// applies a chain of deltas, each against the target of the one before and
+// the first against the source, the result is flattened so that its blocks
+// refer to the source directly, -ELOOP for chains longer than MAX_DIFF_CHAIN
+int load_diff_chain(struct target_stream target[static 1],
+                    struct source_stream source[static 1], int fd_source,
+                    size_t num_deltas, const int fd_deltas[static num_deltas]);
+
+int write_index(struct target_stream target[static 1],
+                struct source_stream source[static 1], int fd_source,
+                int fd_delta, int fd_index);
+
+int load_index(struct target_stream target[static 1],
+               struct source_stream source[static 1], int fd_source,
+               int fd_delta, int fd_index);
 #endif
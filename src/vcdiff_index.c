@@ -0,0 +1,233 @@
+#include "vcdiff_incremental.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REF_BUFSIZE 1024
+
+static int write_all(int fd, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  while (len > 0) {
+    ssize_t written = write(fd, p, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    p += written;
+    len -= written;
+  }
+  return 0;
+}
+
+static int fill_header(struct index_header *header, int fd_source,
+                       int fd_delta) {
+  struct stat stat_source, stat_delta;
+  if (fstat(fd_source, &stat_source) < 0 || fstat(fd_delta, &stat_delta) < 0)
+    return -errno;
+
+  memcpy(header->magic, INDEX_MAGIC, sizeof(header->magic));
+  header->delta_size = stat_delta.st_size;
+  header->delta_mtime_sec = stat_delta.st_mtim.tv_sec;
+  header->delta_mtime_nsec = stat_delta.st_mtim.tv_nsec;
+  header->source_size = stat_source.st_size;
+  header->source_mtime_sec = stat_source.st_mtim.tv_sec;
+  header->source_mtime_nsec = stat_source.st_mtim.tv_nsec;
+  return 0;
+}
+
+static size_t block_len(const struct block_index *index, size_t i) {
+  return index->pos[i + 1] - index->pos[i];
+}
+
+int write_index(struct target_stream target[static 1],
+                struct source_stream source[static 1], int fd_source,
+                int fd_delta, int fd_index) {
+  (void)source;
+  const struct block_index *index = &target->index;
+  if (target->windows || index->pos == NULL)
+    return -EINVAL;
+
+  struct index_header header = {0};
+  int rc = fill_header(&header, fd_source, fd_delta);
+  if (rc < 0)
+    return rc;
+
+  size_t num_blocks = index->num_blocks;
+  size_t num_pos = (num_blocks + SAMPLE_STRIDE) / SAMPLE_STRIDE * SAMPLE_STRIDE;
+  for (size_t i = 0; i < num_blocks; i++)
+    if (!(index->ref[i] & (REF_SOURCE | REF_FILL)))
+      header.data_len += block_len(index, i);
+  header.target_size = target->offset;
+  header.num_blocks = num_blocks;
+  header.num_samples = index->num_samples;
+  header.pos_offset = sizeof(header);
+  header.ref_offset = header.pos_offset + num_pos * sizeof(uint64_t);
+  header.samples_offset = header.ref_offset + num_blocks * sizeof(uint64_t);
+  header.data_offset =
+      header.samples_offset + index->num_samples * sizeof(uint64_t);
+
+  rc = write_all(fd_index, &header, sizeof(header));
+  if (rc < 0)
+    return rc;
+  rc = write_all(fd_index, index->pos, num_pos * sizeof(uint64_t));
+  if (rc < 0)
+    return rc;
+
+  // memory references become offsets into the data section, in block order
+  uint64_t refs[REF_BUFSIZE];
+  size_t num_refs = 0;
+  uint64_t data_offset = 0;
+  for (size_t i = 0; i < num_blocks; i++) {
+    uint64_t ref = index->ref[i];
+    if (!(ref & (REF_SOURCE | REF_FILL))) {
+      ref = data_offset;
+      data_offset += block_len(index, i);
+    }
+    refs[num_refs++] = ref;
+    if (num_refs == REF_BUFSIZE) {
+      rc = write_all(fd_index, refs, sizeof(refs));
+      if (rc < 0)
+        return rc;
+      num_refs = 0;
+    }
+  }
+  rc = write_all(fd_index, refs, num_refs * sizeof(uint64_t));
+  if (rc < 0)
+    return rc;
+
+  rc = write_all(fd_index, index->samples,
+                 index->num_samples * sizeof(uint64_t));
+  if (rc < 0)
+    return rc;
+
+  for (size_t i = 0; i < num_blocks; i++) {
+    if (index->ref[i] & (REF_SOURCE | REF_FILL))
+      continue;
+    rc = write_all(fd_index, (const uint8_t *)(uintptr_t)index->ref[i],
+                   block_len(index, i));
+    if (rc < 0)
+      return rc;
+  }
+  return 0;
+}
+
+// whether an array of count entries at offset fits into the file
+static int in_file(uint64_t offset, uint64_t count, size_t index_len) {
+  return offset % sizeof(uint64_t) == 0 && offset <= index_len &&
+         count <= (index_len - offset) / sizeof(uint64_t);
+}
+
+// the entries are used as offsets into the mappings without further checks,
+// so a damaged or hand-edited index must not get past this
+static int valid_blocks(const struct index_header *header, const uint8_t *map,
+                        uint64_t num_pos) {
+  const uint64_t *pos = (const uint64_t *)(map + header->pos_offset);
+  const uint64_t *ref = (const uint64_t *)(map + header->ref_offset);
+  const uint64_t *samples = (const uint64_t *)(map + header->samples_offset);
+  uint64_t num_blocks = header->num_blocks;
+  if (pos[0] != 0 || pos[num_blocks] != header->target_size)
+    return 0;
+  for (uint64_t i = num_blocks + 1; i < num_pos; i++)
+    if (pos[i] != UINT64_MAX)
+      return 0;
+  for (uint64_t i = 0; i < header->num_samples; i++)
+    if (samples[i] != pos[i * SAMPLE_STRIDE])
+      return 0;
+
+  for (uint64_t i = 0; i < num_blocks; i++) {
+    if (pos[i + 1] < pos[i])
+      return 0;
+    uint64_t len = pos[i + 1] - pos[i];
+    uint64_t offset = ref[i] & ~REF_SOURCE;
+    if (ref[i] & REF_SOURCE) {
+      if (offset > header->source_size || len > header->source_size - offset)
+        return 0;
+    } else if (ref[i] & REF_FILL) {
+      if (ref[i] > (REF_FILL | 0xff))
+        return 0;
+    } else if (offset > header->data_len ||
+               len > header->data_len - offset) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int load_index(struct target_stream target[static 1],
+               struct source_stream source[static 1], int fd_source,
+               int fd_delta, int fd_index) {
+  struct index_header expected = {0};
+  int rc = fill_header(&expected, fd_source, fd_delta);
+  if (rc < 0)
+    return rc;
+
+  struct stat stat_index;
+  if (fstat(fd_index, &stat_index) < 0)
+    return -errno;
+  size_t index_len = stat_index.st_size;
+  if (index_len < sizeof(struct index_header))
+    return -ESTALE;
+
+  uint8_t *map = mmap(NULL, index_len, PROT_READ, MAP_SHARED, fd_index, 0);
+  if (map == MAP_FAILED)
+    return -errno;
+
+  // stale or foreign index files are rejected, the caller decodes instead
+  const struct index_header *header = (const struct index_header *)map;
+  uint64_t num_blocks = header->num_blocks;
+  uint64_t num_pos =
+      (num_blocks + SAMPLE_STRIDE) / SAMPLE_STRIDE * SAMPLE_STRIDE;
+  if (memcmp(header->magic, expected.magic, sizeof(header->magic)) != 0 ||
+      header->delta_size != expected.delta_size ||
+      header->delta_mtime_sec != expected.delta_mtime_sec ||
+      header->delta_mtime_nsec != expected.delta_mtime_nsec ||
+      header->source_size != expected.source_size ||
+      header->source_mtime_sec != expected.source_mtime_sec ||
+      header->source_mtime_nsec != expected.source_mtime_nsec ||
+      num_blocks >= index_len ||
+      header->num_samples !=
+          (num_blocks + SAMPLE_STRIDE - 1) / SAMPLE_STRIDE ||
+      !in_file(header->pos_offset, num_pos, index_len) ||
+      !in_file(header->ref_offset, num_blocks, index_len) ||
+      !in_file(header->samples_offset, header->num_samples, index_len) ||
+      header->data_offset > index_len ||
+      header->data_len > index_len - header->data_offset ||
+      !valid_blocks(header, map, num_pos)) {
+    munmap(map, index_len);
+    return -ESTALE;
+  }
+
+  *source = (struct source_stream){.target = target};
+  rc = map_source(source, fd_source);
+  if (rc < 0) {
+    munmap(map, index_len);
+    return rc;
+  }
+
+  uint64_t *samples = (uint64_t *)(map + header->samples_offset);
+  *target = (struct target_stream){
+      .offset = header->target_size,
+      .index = {.pos = (uint64_t *)(map + header->pos_offset),
+                .ref = (uint64_t *)(map + header->ref_offset),
+                .samples = header->num_samples ? samples : NULL,
+                .num_samples = header->num_samples,
+                .num_blocks = num_blocks,
+                .capacity = num_blocks,
+                .data_base = map + header->data_offset},
+      .data_len = header->data_len,
+      .source_data = source->data,
+      .source_len = source->len,
+      .source_fd = source->fd,
+      .index_map = map,
+      .index_len = index_len};
+
+  // entries are only touched by lookups, let the kernel fetch them on demand
+  madvise(map, index_len, MADV_RANDOM);
+  return 0;
+}
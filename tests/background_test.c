@@ -0,0 +1,143 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN (1 << 20)
+#define WINDOWS 128
+#define READERS 4
+#define READS 200
+
+struct reader {
+  pthread_t thread;
+  struct target_stream *target;
+  const uint8_t *expected;
+  size_t len;
+  unsigned seed;
+  int failed;
+};
+
+// reads random ranges while the delta is still being decoded
+static void *read_ranges(void *arg) {
+  struct reader *reader = arg;
+  uint8_t *data = malloc(70000);
+  reader->failed = data == NULL;
+  for (int i = 0; i < READS && !reader->failed; i++) {
+    size_t offset = rand_r(&reader->seed) % reader->len;
+    size_t n = 1 + rand_r(&reader->seed) % 70000;
+    if (n > reader->len - offset)
+      n = reader->len - offset;
+    reader->failed = read_range(reader->target, offset, n, data) != (int)n ||
+                     memcmp(data, reader->expected + offset, n) != 0;
+  }
+  free(data);
+  return NULL;
+}
+
+static int test_readers(int fd_base, int fd_delta, const uint8_t *expected,
+                        size_t len) {
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff_background(&target, &source, fd_base, fd_delta) == 0);
+
+  struct reader readers[READERS];
+  for (int i = 0; i < READERS; i++) {
+    readers[i] = (struct reader){.target = &target,
+                                 .expected = expected,
+                                 .len = len,
+                                 .seed = i + 1};
+    CHECK(pthread_create(&readers[i].thread, NULL, read_ranges,
+                         &readers[i]) == 0);
+  }
+  // the index is read while it is being built
+  memory_usage(&target);
+  int failed = 0;
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(readers[i].thread, NULL);
+    failed |= readers[i].failed;
+  }
+
+  uint8_t *data = malloc(len);
+  CHECK(data != NULL);
+  int same = read_range(&target, 0, len, data) == (int)len &&
+             memcmp(data, expected, len) == 0;
+  free(data);
+  CHECK(target.offset == len);
+  free_data(&target, &source);
+  CHECK(!failed);
+  CHECK(same);
+  return 0;
+}
+
+// what was decoded before an error can still be read, reads past it fail
+static int test_truncated(int fd_base, const char *dir,
+                          const uint8_t *expected, size_t len,
+                          const uint8_t *delta, size_t delta_len) {
+  char path[96];
+  test_path(path, dir, "truncated");
+  CHECK(write_file(path, delta, delta_len - 100) == 0);
+  int fd_delta = open(path, O_RDONLY);
+  CHECK(fd_delta >= 0);
+
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff_background(&target, &source, fd_base, fd_delta) == 0);
+  uint8_t start[4096], end[4096];
+  int start_rc = read_range(&target, 0, sizeof(start), start);
+  int end_rc = read_range(&target, len - sizeof(end), sizeof(end), end);
+  free_data(&target, &source);
+  close(fd_delta);
+  unlink(path);
+
+  CHECK(start_rc == sizeof(start));
+  CHECK(memcmp(start, expected, sizeof(start)) == 0);
+  CHECK(end_rc < 0);
+  return 0;
+}
+
+int main(void) {
+  char dir[64], base_path[96], delta_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_path, dir, "delta");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected =
+      write_random_delta(delta_path, base, BASE_LEN, WINDOWS, 3, &len);
+  CHECK(expected != NULL);
+
+  int fd_base = open(base_path, O_RDONLY);
+  int fd_delta = open(delta_path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+
+  CHECK(test_readers(fd_base, fd_delta, expected, len) == 0);
+
+  // closing while the decoder runs cancels it
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff_background(&target, &source, fd_base, fd_delta) == 0);
+  CHECK(free_data(&target, &source) == 0);
+
+  off_t delta_len = lseek(fd_delta, 0, SEEK_END);
+  uint8_t *delta = malloc(delta_len);
+  CHECK(delta != NULL);
+  CHECK(pread(fd_delta, delta, delta_len, 0) == delta_len);
+  CHECK(test_truncated(fd_base, dir, expected, len, delta, delta_len) == 0);
+
+  close(fd_delta);
+  close(fd_base);
+  unlink(delta_path);
+  unlink(base_path);
+  rmdir(dir);
+  free(delta);
+  free(expected);
+  free(base);
+  return 0;
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+// a large image patched twice without changes, the flattened chain is a
+// single copy longer than 4 GiB
+#define LARGE_LEN ((size_t)4 << 30 | 16)
+#define LARGE_WINDOW (64 * 1024 * 1024)
+
+static int check_target(struct target_stream *target, const uint8_t *expected,
+                        size_t len) {
+  CHECK(target->offset == len);
+  uint8_t *data = malloc(len);
+  CHECK(data != NULL);
+  int rc = read_range(target, 0, len, data);
+  int same = rc == (int)len && memcmp(data, expected, len) == 0;
+  free(data);
+  CHECK(same);
+  return 0;
+}
+
+// every delta in the chain is applied to the target of the one before
+static int test_chain(const char *dir) {
+  char paths[3][96];
+  size_t base_len = 1 << 20;
+  uint8_t *targets[4] = {random_data(base_len, 1)};
+  size_t lens[4] = {base_len};
+  CHECK(targets[0] != NULL);
+  char base_path[96];
+  test_path(base_path, dir, "base");
+  CHECK(write_file(base_path, targets[0], base_len) == 0);
+
+  int fds[3];
+  for (int i = 0; i < 3; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "delta%i", i);
+    test_path(paths[i], dir, name);
+    targets[i + 1] = write_random_delta(paths[i], targets[i], lens[i], 48,
+                                        i + 2, &lens[i + 1]);
+    CHECK(targets[i + 1] != NULL);
+    fds[i] = open(paths[i], O_RDONLY);
+    CHECK(fds[i] >= 0);
+  }
+
+  int fd_base = open(base_path, O_RDONLY);
+  CHECK(fd_base >= 0);
+  for (size_t depth = 1; depth <= 3; depth++) {
+    struct target_stream target;
+    struct source_stream source;
+    CHECK(load_diff_chain(&target, &source, fd_base, depth, fds) == 0);
+    // flattened blocks only refer to the base
+    CHECK(target.source_fd == source.fd);
+    CHECK(target.source_len == base_len);
+    int rc = check_target(&target, targets[depth], lens[depth]);
+    free_data(&target, &source);
+    CHECK(rc == 0);
+  }
+
+  int long_chain[MAX_DIFF_CHAIN + 1];
+  for (int i = 0; i <= MAX_DIFF_CHAIN; i++)
+    long_chain[i] = fds[0];
+  struct target_stream target = {0};
+  struct source_stream source = {0};
+  CHECK(load_diff_chain(&target, &source, fd_base, MAX_DIFF_CHAIN + 1,
+                        long_chain) == -ELOOP);
+
+  close(fd_base);
+  unlink(base_path);
+  for (int i = 0; i < 3; i++) {
+    close(fds[i]);
+    unlink(paths[i]);
+  }
+  for (int i = 0; i < 4; i++)
+    free(targets[i]);
+  return 0;
+}
+
+// copies the whole source, one merged block for the decoder
+static int write_identity(const char *path, size_t len) {
+  struct delta_writer writer;
+  int rc = delta_writer_open(&writer, path, len);
+  for (size_t pos = 0; pos < len && rc >= 0; pos += LARGE_WINDOW) {
+    size_t n = len - pos < LARGE_WINDOW ? len - pos : LARGE_WINDOW;
+    rc = delta_copy(&writer, pos, n);
+    if (rc >= 0)
+      rc = delta_end_window(&writer);
+  }
+  int close_rc = delta_writer_close(&writer);
+  return rc < 0 ? rc : close_rc;
+}
+
+static int test_large_chain(const char *dir) {
+  char base_path[96], paths[2][96];
+  test_path(base_path, dir, "large");
+  test_path(paths[0], dir, "large0");
+  test_path(paths[1], dir, "large1");
+
+  // sparse apart from a few marks, reads of it cost next to nothing
+  static const size_t marks[] = {0, (size_t)1 << 31, (size_t)9 << 28,
+                                 ((size_t)4 << 30) - 8, LARGE_LEN - 8};
+  int fd_base = open(base_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd_base >= 0);
+  CHECK(ftruncate(fd_base, LARGE_LEN) == 0);
+  for (size_t i = 0; i < sizeof(marks) / sizeof(*marks); i++)
+    CHECK(pwrite(fd_base, "patchfs!", 8, marks[i]) == 8);
+  CHECK(write_identity(paths[0], LARGE_LEN) == 0);
+  CHECK(write_identity(paths[1], LARGE_LEN) == 0);
+
+  int fds[2] = {open(paths[0], O_RDONLY), open(paths[1], O_RDONLY)};
+  CHECK(fds[0] >= 0 && fds[1] >= 0);
+  struct target_stream target;
+  struct source_stream source;
+  int rc = load_diff_chain(&target, &source, fd_base, 2, fds);
+  if (rc < 0)
+    fprintf(stderr, "load_diff_chain: %s\n", strerror(-rc));
+  CHECK(rc == 0);
+  CHECK(target.offset == LARGE_LEN);
+  CHECK(target.index.num_blocks == 1);
+  for (size_t i = 0; i < sizeof(marks) / sizeof(*marks); i++) {
+    uint8_t data[16] = {0};
+    size_t len = LARGE_LEN - marks[i] < 16 ? LARGE_LEN - marks[i] : 16;
+    CHECK(read_range(&target, marks[i], len, data) == (int)len);
+    CHECK(memcmp(data, "patchfs!", 8) == 0);
+  }
+  free_data(&target, &source);
+
+  close(fds[0]);
+  close(fds[1]);
+  close(fd_base);
+  unlink(paths[0]);
+  unlink(paths[1]);
+  unlink(base_path);
+  return 0;
+}
+
+int main(void) {
+  char dir[64];
+  CHECK(test_dir(dir) == 0);
+  int rc = test_chain(dir);
+  if (rc == 0)
+    rc = test_large_chain(dir);
+  rmdir(dir);
+  return rc;
+}
@@ -0,0 +1,88 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN (4 << 20)
+#define WINDOWS 160
+#define CHUNK 4096
+// the largest prefetch window
+#define PREFETCH_MAX (8 << 20)
+
+// reads the target in chunks through one cursor, the prefetched range grows
+// ahead of sequential reads without running away, and a jump starts over
+static int check_cursor(struct target_stream *target, const uint8_t *expected,
+                        size_t len) {
+  CHECK(target->offset == len);
+  struct read_cursor cursor = {0};
+  uint8_t data[CHUNK];
+  int same = 1;
+  for (size_t offset = 0; offset < len && same; offset += CHUNK) {
+    size_t n = len - offset < CHUNK ? len - offset : CHUNK;
+    same = read_range_cursor(target, &cursor, offset, n, data) == (int)n &&
+           memcmp(data, expected + offset, n) == 0;
+    size_t ahead = atomic_load(&cursor.ahead);
+    same = same && atomic_load(&cursor.next) == offset + n &&
+           ahead > offset + n && ahead <= offset + n + PREFETCH_MAX;
+  }
+  CHECK(same);
+  CHECK(atomic_load(&cursor.streak) > 0);
+
+  size_t offset = len / 3;
+  CHECK(read_range_cursor(target, &cursor, offset, CHUNK, data) == CHUNK);
+  CHECK(memcmp(data, expected + offset, CHUNK) == 0);
+  CHECK(atomic_load(&cursor.streak) == 0);
+  CHECK(atomic_load(&cursor.ahead) == offset + CHUNK);
+
+  // a second sequential read prefetches again
+  CHECK(read_range_cursor(target, &cursor, offset + CHUNK, CHUNK, data) ==
+        CHUNK);
+  CHECK(memcmp(data, expected + offset + CHUNK, CHUNK) == 0);
+  CHECK(atomic_load(&cursor.streak) == 1);
+  CHECK(atomic_load(&cursor.ahead) > offset + 2 * CHUNK);
+  return 0;
+}
+
+// prefetching works on the finished index of a decoded delta and on the
+// windows of a lazily decoded one that were already decoded
+int main(void) {
+  char dir[64], base_path[96], delta_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_path, dir, "delta");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected =
+      write_random_delta(delta_path, base, BASE_LEN, WINDOWS, 9, &len);
+  CHECK(expected != NULL);
+  int fd_base = open(base_path, O_RDONLY);
+  int fd_delta = open(delta_path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff(&target, &source, fd_base, fd_delta) == 0);
+  int rc = check_cursor(&target, expected, len);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  CHECK(load_diff_lazy(&target, &source, fd_base, fd_delta) == 0);
+  rc = check_cursor(&target, expected, len);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  close(fd_delta);
+  close(fd_base);
+  unlink(delta_path);
+  unlink(base_path);
+  rmdir(dir);
+  free(expected);
+  free(base);
+  return 0;
+}
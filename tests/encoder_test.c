@@ -0,0 +1,243 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+// more than two windows of the encoder
+#define BASE_LEN ((9 << 20) + 5000)
+#define CHANGED_LEN 4096
+#define TAIL_AT (4 << 20)
+#define TAIL_LEN 10000
+#define RANDOM_LEN 20000
+#define OLD_PATH "base/old"
+
+extern char **environ;
+
+static const char *encoder_path;
+
+// runs the encoder with stdin read from stdin_path if it is set, returns its
+// exit status
+static int run_encoder(char *const args[], const char *stdin_path) {
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (stdin_path)
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, stdin_path,
+                                     O_RDONLY, 0);
+  pid_t pid;
+  int rc = posix_spawn(&pid, encoder_path, &actions, NULL, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (rc != 0)
+    return -1;
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+// the delta at path names the base in its xattrs and patches it into expected
+static int check_delta(const char *path, const char *old_path,
+                       const uint8_t *expected, size_t len) {
+  char value[64];
+  ssize_t n = getxattr(path, "user.diff_src", value, sizeof(value) - 1);
+  CHECK(n == (ssize_t)strlen(OLD_PATH) && memcmp(value, OLD_PATH, n) == 0);
+  n = getxattr(path, "user.diff_src_size", value, sizeof(value) - 1);
+  CHECK(n > 0);
+  value[n] = '\0';
+  CHECK(strtoull(value, NULL, 10) == len);
+
+  int fd_base = open(old_path, O_RDONLY);
+  int fd_delta = open(path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+  struct target_stream target;
+  struct source_stream source;
+  int rc = load_diff(&target, &source, fd_base, fd_delta);
+  close(fd_delta);
+  close(fd_base);
+  CHECK(rc == 0);
+  uint8_t *data = malloc(len);
+  int same = data && target.offset == len &&
+             read_range(&target, 0, len, data) == (int)len &&
+             memcmp(data, expected, len) == 0;
+  free(data);
+  free_data(&target, &source);
+  CHECK(same);
+  return 0;
+}
+
+// a target that did not shrink is copied as is, without xattrs
+static int check_copy(const char *path, const uint8_t *expected, size_t len) {
+  char value[64];
+  CHECK(getxattr(path, "user.diff_src", value, sizeof(value)) < 0 &&
+        errno == ENODATA);
+  int fd = open(path, O_RDONLY);
+  CHECK(fd >= 0);
+  uint8_t *data = malloc(len + 1);
+  int same = data && pread(fd, data, len + 1, 0) == (ssize_t)len &&
+             memcmp(data, expected, len) == 0;
+  free(data);
+  close(fd);
+  CHECK(same);
+  return 0;
+}
+
+// nothing but the outputs is left in a directory
+static size_t count_entries(const char *path) {
+  DIR *dp = opendir(path);
+  if (dp == NULL)
+    return SIZE_MAX;
+  size_t count = 0;
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL)
+    count += strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0;
+  closedir(dp);
+  return count;
+}
+
+struct targets {
+  uint8_t *changed;
+  uint8_t *tail;
+  size_t tail_len;
+  uint8_t *random;
+};
+
+// a copy of the base with a block changed, its end with data appended and
+// unrelated data
+static int write_targets(const char *new_dir, const uint8_t *old,
+                         struct targets *targets) {
+  char path[192], sub_dir[160];
+  targets->changed = malloc(BASE_LEN);
+  CHECK(targets->changed != NULL);
+  memcpy(targets->changed, old, BASE_LEN);
+  uint8_t *block = random_data(CHANGED_LEN, 3);
+  CHECK(block != NULL);
+  memcpy(targets->changed + (5 << 20), block, CHANGED_LEN);
+  free(block);
+  snprintf(path, sizeof(path), "%s/a", new_dir);
+  CHECK(write_file(path, targets->changed, BASE_LEN) == 0);
+
+  targets->tail_len = BASE_LEN - TAIL_AT + TAIL_LEN;
+  targets->tail = malloc(targets->tail_len);
+  uint8_t *appended = random_data(TAIL_LEN, 4);
+  CHECK(targets->tail != NULL && appended != NULL);
+  memcpy(targets->tail, old + TAIL_AT, BASE_LEN - TAIL_AT);
+  memcpy(targets->tail + BASE_LEN - TAIL_AT, appended, TAIL_LEN);
+  free(appended);
+  snprintf(sub_dir, sizeof(sub_dir), "%s/sub", new_dir);
+  CHECK(mkdir(sub_dir, 0755) == 0);
+  snprintf(path, sizeof(path), "%s/b", sub_dir);
+  CHECK(write_file(path, targets->tail, targets->tail_len) == 0);
+
+  targets->random = random_data(RANDOM_LEN, 5);
+  CHECK(targets->random != NULL);
+  snprintf(path, sizeof(path), "%s/c", new_dir);
+  CHECK(write_file(path, targets->random, RANDOM_LEN) == 0);
+  return 0;
+}
+
+static int check_outputs(const char *diff_dir, const char *old_path,
+                         const struct targets *targets) {
+  char path[192];
+  snprintf(path, sizeof(path), "%s/a", diff_dir);
+  CHECK(check_delta(path, old_path, targets->changed, BASE_LEN) == 0);
+  snprintf(path, sizeof(path), "%s/sub/b", diff_dir);
+  CHECK(check_delta(path, old_path, targets->tail, targets->tail_len) == 0);
+  snprintf(path, sizeof(path), "%s/c", diff_dir);
+  CHECK(check_copy(path, targets->random, RANDOM_LEN) == 0);
+  CHECK(count_entries(diff_dir) == 3);
+  snprintf(path, sizeof(path), "%s/sub", diff_dir);
+  CHECK(count_entries(path) == 1);
+  return 0;
+}
+
+// encodes a directory of targets against one base, a list of them read from
+// stdin, and one target on several threads as well as an empty one, outputs
+// replace older ones with their xattrs
+int main(int argc, char *argv[]) {
+  CHECK(argc == 2);
+  encoder_path = argv[1];
+
+  char dir[64], old_path[96], new_dir[96], diff_dir[96], list_path[96],
+      single_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(old_path, dir, "old");
+  test_path(new_dir, dir, "new");
+  test_path(diff_dir, dir, "diff");
+  test_path(list_path, dir, "list");
+  test_path(single_path, dir, "single");
+  CHECK(mkdir(new_dir, 0755) == 0 && mkdir(diff_dir, 0755) == 0);
+
+  uint8_t *old = random_data(BASE_LEN, 1);
+  CHECK(old != NULL);
+  CHECK(write_file(old_path, old, BASE_LEN) == 0);
+  struct targets targets;
+  CHECK(write_targets(new_dir, old, &targets) == 0);
+
+  // a delta from before that is now replaced by a copy loses its xattrs
+  char path[192];
+  snprintf(path, sizeof(path), "%s/c", diff_dir);
+  CHECK(write_file(path, old, 100) == 0);
+  CHECK(setxattr(path, "user.diff_src", "stale", 5, 0) == 0);
+
+  char *batch[] = {"encoder", "-b",    "-t",    "2",      old_path,
+                   OLD_PATH,  new_dir, diff_dir, NULL};
+  CHECK(run_encoder(batch, NULL) == 0);
+  CHECK(check_outputs(diff_dir, old_path, &targets) == 0);
+
+  // listed paths are relative to the working directory and must stay below
+  // the diff directory
+  CHECK(chdir(new_dir) == 0);
+  char *listed[] = {"encoder", "-b", old_path, OLD_PATH, "-", diff_dir, NULL};
+  static const char outside[] = "a\n../c\n";
+  CHECK(write_file(list_path, (const uint8_t *)outside,
+                   sizeof(outside) - 1) == 0);
+  CHECK(run_encoder(listed, list_path) == 1);
+  static const char list[] = "a\nsub/b\n\nc\n";
+  CHECK(write_file(list_path, (const uint8_t *)list, sizeof(list) - 1) == 0);
+  CHECK(run_encoder(listed, list_path) == 0);
+  CHECK(chdir("/") == 0);
+  CHECK(check_outputs(diff_dir, old_path, &targets) == 0);
+
+  // windows of one target encoded on several threads make one delta
+  snprintf(path, sizeof(path), "%s/a", new_dir);
+  char *single[] = {"encoder", "-t", "4", old_path, single_path, OLD_PATH,
+                    path,      NULL};
+  CHECK(run_encoder(single, NULL) == 0);
+  CHECK(check_delta(single_path, old_path, targets.changed, BASE_LEN) == 0);
+  // an empty target cannot be mapped but still gets a delta
+  CHECK(write_file(path, old, 0) == 0);
+  CHECK(run_encoder(single, NULL) == 0);
+  CHECK(check_delta(single_path, old_path, old, 0) == 0);
+
+  const char *names[] = {"a", "sub/b", "c"};
+  for (int i = 0; i < 3; i++) {
+    snprintf(path, sizeof(path), "%s/%s", diff_dir, names[i]);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/%s", new_dir, names[i]);
+    unlink(path);
+  }
+  snprintf(path, sizeof(path), "%s/sub", diff_dir);
+  rmdir(path);
+  snprintf(path, sizeof(path), "%s/sub", new_dir);
+  rmdir(path);
+  rmdir(diff_dir);
+  rmdir(new_dir);
+  unlink(single_path);
+  unlink(list_path);
+  unlink(old_path);
+  rmdir(dir);
+  free(targets.random);
+  free(targets.tail);
+  free(targets.changed);
+  free(old);
+  return 0;
+}
@@ -0,0 +1,165 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN (1 << 20)
+#define WINDOWS 64
+
+static int check_target(struct target_stream *target, const uint8_t *expected,
+                        size_t len) {
+  CHECK(target->offset == len);
+  uint8_t *data = malloc(len);
+  CHECK(data != NULL);
+  int same = read_range(target, 0, len, data) == (int)len &&
+             memcmp(data, expected, len) == 0;
+  free(data);
+  CHECK(same);
+  return 0;
+}
+
+static int load(const char *index_path, int fd_base, int fd_delta) {
+  int fd_index = open(index_path, O_RDONLY);
+  if (fd_index < 0)
+    return -errno;
+  struct target_stream target;
+  struct source_stream source;
+  int rc = load_index(&target, &source, fd_base, fd_delta, fd_index);
+  close(fd_index);
+  if (rc == 0)
+    free_data(&target, &source);
+  return rc;
+}
+
+// the index with one entry changed has to be refused
+static int check_corrupt(const char *path, const uint8_t *index,
+                         size_t index_len, uint64_t offset, uint64_t value,
+                         int fd_base, int fd_delta) {
+  uint8_t *copy = malloc(index_len);
+  CHECK(copy != NULL);
+  memcpy(copy, index, index_len);
+  memcpy(copy + offset, &value, sizeof(value));
+  int rc = write_file(path, copy, index_len);
+  free(copy);
+  CHECK(rc == 0);
+  CHECK(load(path, fd_base, fd_delta) == -ESTALE);
+  return 0;
+}
+
+static int test_corrupt(const char *dir, const char *index_path, int fd_base,
+                        int fd_delta) {
+  int fd_index = open(index_path, O_RDONLY);
+  CHECK(fd_index >= 0);
+  struct stat st;
+  CHECK(fstat(fd_index, &st) == 0);
+  size_t index_len = st.st_size;
+  uint8_t *index = malloc(index_len);
+  CHECK(index != NULL);
+  CHECK(pread(fd_index, index, index_len, 0) == (ssize_t)index_len);
+  close(fd_index);
+
+  struct index_header header;
+  memcpy(&header, index, sizeof(header));
+  const uint64_t *pos = (const uint64_t *)(index + header.pos_offset);
+  const uint64_t *ref = (const uint64_t *)(index + header.ref_offset);
+  size_t source_block = SIZE_MAX, data_block = SIZE_MAX;
+  for (size_t i = 0; i < header.num_blocks; i++) {
+    if (ref[i] & REF_SOURCE)
+      source_block = i;
+    else if (!(ref[i] & REF_FILL))
+      data_block = i;
+  }
+  CHECK(source_block != SIZE_MAX && data_block != SIZE_MAX);
+  CHECK(header.num_blocks % SAMPLE_STRIDE != SAMPLE_STRIDE - 1);
+
+  char path[96];
+  test_path(path, dir, "corrupt");
+  uint64_t ref_at = header.ref_offset, pos_at = header.pos_offset;
+  uint64_t source_end =
+      header.source_size - (pos[source_block + 1] - pos[source_block]) + 1;
+  uint64_t data_end =
+      header.data_len - (pos[data_block + 1] - pos[data_block]) + 1;
+  int rc = check_corrupt(path, index, index_len, ref_at + source_block * 8,
+                         REF_SOURCE | source_end, fd_base, fd_delta);
+  if (rc == 0)
+    rc = check_corrupt(path, index, index_len, ref_at + data_block * 8,
+                       data_end, fd_base, fd_delta);
+  if (rc == 0)
+    rc = check_corrupt(path, index, index_len, ref_at, REF_FILL | 0x100,
+                       fd_base, fd_delta);
+  // positions running backwards, past the target and bad padding
+  if (rc == 0)
+    rc = check_corrupt(path, index, index_len, pos_at + 8 * 2, pos[1] - 1,
+                       fd_base, fd_delta);
+  if (rc == 0)
+    rc = check_corrupt(path, index, index_len, pos_at + 8 * header.num_blocks,
+                       header.target_size + 1, fd_base, fd_delta);
+  if (rc == 0)
+    rc = check_corrupt(path, index, index_len,
+                       pos_at + 8 * (header.num_blocks + 1), 0, fd_base,
+                       fd_delta);
+  unlink(path);
+  free(index);
+  return rc;
+}
+
+// an index written for a decoded delta maps to the same target, and is
+// refused once it is damaged or the delta changed
+int main(void) {
+  char dir[64], base_path[96], delta_path[96], index_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_path, dir, "delta");
+  test_path(index_path, dir, "index");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected =
+      write_random_delta(delta_path, base, BASE_LEN, WINDOWS, 4, &len);
+  CHECK(expected != NULL);
+  int fd_base = open(base_path, O_RDONLY);
+  int fd_delta = open(delta_path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff(&target, &source, fd_base, fd_delta) == 0);
+  int fd_index = open(index_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd_index >= 0);
+  int rc = write_index(&target, &source, fd_base, fd_delta, fd_index);
+  free_data(&target, &source);
+  CHECK(close(fd_index) == 0 && rc == 0);
+
+  fd_index = open(index_path, O_RDONLY);
+  CHECK(fd_index >= 0);
+  CHECK(load_index(&target, &source, fd_base, fd_delta, fd_index) == 0);
+  close(fd_index);
+  rc = check_target(&target, expected, len);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  CHECK(test_corrupt(dir, index_path, fd_base, fd_delta) == 0);
+
+  // a delta with a different mtime makes the index stale
+  struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = 1}};
+  CHECK(futimens(fd_delta, times) == 0);
+  CHECK(load(index_path, fd_base, fd_delta) == -ESTALE);
+
+  close(fd_delta);
+  close(fd_base);
+  unlink(index_path);
+  unlink(delta_path);
+  unlink(base_path);
+  rmdir(dir);
+  free(expected);
+  free(base);
+  return 0;
+}
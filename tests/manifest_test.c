@@ -0,0 +1,125 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "manifest.h"
+#include "test_util.h"
+
+// a file below the diff directory, marked as patched if size is set
+static int add_file(const char *dir, const char *name, const char *size) {
+  char path[192];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  static const uint8_t data[100];
+  CHECK(write_file(path, data, strlen(name)) == 0);
+  if (size)
+    CHECK(setxattr(path, "user.diff_src_size", size, strlen(size), 0) == 0);
+  return 0;
+}
+
+// the entry for a patched file matches it as it was when the manifest was
+// built
+static int check_entry(const struct manifest *manifest, const char *diff_dir,
+                       const char *dir, const char *name, off_t target_size) {
+  const struct manifest_entry *entry = manifest_find(manifest, dir, name);
+  CHECK(entry != NULL);
+  char path[192];
+  snprintf(path, sizeof(path), "%s/%s%s%s", diff_dir, dir, dir[0] ? "/" : "",
+           name);
+  struct stat st;
+  CHECK(stat(path, &st) == 0);
+  CHECK(entry->target_size == target_size);
+  CHECK(entry->delta_size == st.st_size);
+  CHECK(entry->ctime.tv_sec == st.st_ctim.tv_sec &&
+        entry->ctime.tv_nsec == st.st_ctim.tv_nsec);
+  return 0;
+}
+
+static int load(struct manifest *manifest, const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+  int rc = manifest_load(manifest, fd);
+  close(fd);
+  return rc;
+}
+
+// patched files are found by their directory and name, unpatched ones are
+// left out, a damaged manifest is refused
+int main(void) {
+  char dir[64], diff_dir[96], sub_dir[96], deeper_dir[128], manifest_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(diff_dir, dir, "diff");
+  test_path(manifest_path, dir, "manifest");
+  test_path(sub_dir, diff_dir, "sub");
+  snprintf(deeper_dir, sizeof(deeper_dir), "%s/deeper", sub_dir);
+  CHECK(mkdir(diff_dir, 0755) == 0 && mkdir(sub_dir, 0755) == 0 &&
+        mkdir(deeper_dir, 0755) == 0);
+  CHECK(add_file(diff_dir, "a", "1234") == 0);
+  CHECK(add_file(diff_dir, "plain", NULL) == 0);
+  CHECK(add_file(sub_dir, "b", "99") == 0);
+  CHECK(add_file(deeper_dir, "c", "5") == 0);
+
+  int fd = open(manifest_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd >= 0);
+  int rc = manifest_build(diff_dir, fd);
+  CHECK(close(fd) == 0 && rc == 0);
+
+  struct manifest manifest;
+  CHECK(load(&manifest, manifest_path) == 0);
+  rc = check_entry(&manifest, diff_dir, "", "a", 1234);
+  if (rc == 0)
+    rc = check_entry(&manifest, diff_dir, "sub", "b", 99);
+  if (rc == 0)
+    rc = check_entry(&manifest, diff_dir, "sub/deeper", "c", 5);
+  int missing = manifest_find(&manifest, "", "plain") == NULL &&
+                manifest_find(&manifest, "", "b") == NULL &&
+                manifest_find(&manifest, "sub", "a") == NULL &&
+                manifest_find(&manifest, "sub", "deeper") == NULL;
+
+  // changing the xattrs of a delta moves its ctime past its entry
+  char path[192];
+  snprintf(path, sizeof(path), "%s/a", diff_dir);
+  struct timespec pause = {.tv_nsec = 10000000};
+  nanosleep(&pause, NULL);
+  CHECK(setxattr(path, "user.diff_src_size", "4321", 4, 0) == 0);
+  struct stat st;
+  CHECK(stat(path, &st) == 0);
+  const struct manifest_entry *entry = manifest_find(&manifest, "", "a");
+  int changed = entry && (entry->ctime.tv_sec != st.st_ctim.tv_sec ||
+                          entry->ctime.tv_nsec != st.st_ctim.tv_nsec);
+  manifest_free(&manifest);
+  CHECK(rc == 0);
+  CHECK(missing);
+  CHECK(changed);
+
+  // records cut off or a wrong magic
+  struct manifest_header header = {.magic = MANIFEST_MAGIC, .num_records = 3};
+  CHECK(write_file(manifest_path, (const uint8_t *)&header,
+                   sizeof(header)) == 0);
+  CHECK(load(&manifest, manifest_path) == -EINVAL);
+  header = (struct manifest_header){.magic = "VCDMAN00"};
+  CHECK(write_file(manifest_path, (const uint8_t *)&header,
+                   sizeof(header)) == 0);
+  CHECK(load(&manifest, manifest_path) == -EINVAL);
+
+  snprintf(path, sizeof(path), "%s/c", deeper_dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/b", sub_dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/plain", diff_dir);
+  unlink(path);
+  snprintf(path, sizeof(path), "%s/a", diff_dir);
+  unlink(path);
+  rmdir(deeper_dir);
+  rmdir(sub_dir);
+  rmdir(diff_dir);
+  unlink(manifest_path);
+  rmdir(dir);
+  return 0;
+}
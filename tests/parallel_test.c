@@ -0,0 +1,77 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN (1 << 20)
+#define WINDOWS 64
+#define READS 1000
+
+// reads the whole target and random ranges of it
+static int check_reads(struct target_stream *target, const uint8_t *expected,
+                       size_t len) {
+  CHECK(target->offset == len);
+  uint8_t *data = malloc(len);
+  CHECK(data != NULL);
+  int same = read_range(target, 0, len, data) == (int)len &&
+             memcmp(data, expected, len) == 0;
+  srand(7);
+  for (int i = 0; i < READS && same; i++) {
+    size_t offset = rand() % len;
+    size_t n = 1 + rand() % 70000;
+    if (n > len - offset)
+      n = len - offset;
+    same = read_range(target, offset, n, data) == (int)n &&
+           memcmp(data, expected + offset, n) == 0;
+  }
+  free(data);
+  CHECK(same);
+  return 0;
+}
+
+// windows of a delta that only copy from the source are decoded on all
+// cores by load_diff, and one by one on first access by load_diff_lazy,
+// both have to give the target a single pass decodes to
+int main(void) {
+  char dir[64], base_path[96], delta_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_path, dir, "delta");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected =
+      write_random_delta(delta_path, base, BASE_LEN, WINDOWS, 2, &len);
+  CHECK(expected != NULL);
+
+  int fd_base = open(base_path, O_RDONLY);
+  int fd_delta = open(delta_path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff(&target, &source, fd_base, fd_delta) == 0);
+  int rc = check_reads(&target, expected, len);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  CHECK(load_diff_lazy(&target, &source, fd_base, fd_delta) == 0);
+  CHECK(target.num_windows == WINDOWS);
+  rc = check_reads(&target, expected, len);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  close(fd_delta);
+  close(fd_base);
+  unlink(delta_path);
+  unlink(base_path);
+  rmdir(dir);
+  free(expected);
+  free(base);
+  return 0;
+}
@@ -0,0 +1,149 @@
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "test_util.h"
+
+#define BASE_LEN (4 << 20)
+#define WINDOWS 160
+#define RANGE_START 1000000
+#define RANGE_LEN 3000000
+
+extern char **environ;
+
+static const char *partial_path;
+
+// runs vcdiff-partial with the delta on stdin and stdout going to out_path,
+// the delta is written through a pipe if pipe_delta is set, returns the exit
+// status
+static int run_partial(char *const args[], const char *delta_path,
+                       const uint8_t *delta, size_t delta_len, int pipe_delta,
+                       const char *out_path) {
+  int fds[2] = {-1, -1};
+  if (pipe_delta && pipe(fds) < 0)
+    return -1;
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (pipe_delta) {
+    posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+  } else {
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, delta_path,
+                                     O_RDONLY, 0);
+  }
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, out_path,
+                                   O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  pid_t pid;
+  int rc = posix_spawn(&pid, partial_path, &actions, NULL, args, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (pipe_delta) {
+    close(fds[0]);
+    for (size_t done = 0; rc == 0 && done < delta_len;) {
+      ssize_t n = write(fds[1], delta + done, delta_len - done);
+      if (n <= 0)
+        break;
+      done += n;
+    }
+    close(fds[1]);
+  }
+  if (rc != 0)
+    return -1;
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+static int check_output(const char *path, const uint8_t *expected,
+                        size_t len) {
+  int fd = open(path, O_RDONLY);
+  CHECK(fd >= 0);
+  struct stat st;
+  CHECK(fstat(fd, &st) == 0);
+  uint8_t *data = malloc(len + 1);
+  int same = data && (size_t)st.st_size == len &&
+             pread(fd, data, len + 1, 0) == (ssize_t)len &&
+             memcmp(data, expected, len) == 0;
+  free(data);
+  close(fd);
+  CHECK(same);
+  return 0;
+}
+
+// the whole target and ranges of it, from a mapped delta and from a pipe,
+// written to stdout and to a file by several threads
+int main(int argc, char *argv[]) {
+  CHECK(argc == 2);
+  partial_path = argv[1];
+
+  char dir[64], base_path[96], delta_path[96], out_path[96], file_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_path, dir, "delta");
+  test_path(out_path, dir, "out");
+  test_path(file_path, dir, "file");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected =
+      write_random_delta(delta_path, base, BASE_LEN, WINDOWS, 7, &len);
+  CHECK(expected != NULL);
+  CHECK(len > RANGE_START + RANGE_LEN);
+  int fd_delta = open(delta_path, O_RDONLY);
+  CHECK(fd_delta >= 0);
+  off_t delta_len = lseek(fd_delta, 0, SEEK_END);
+  uint8_t *delta = malloc(delta_len);
+  CHECK(delta != NULL);
+  CHECK(pread(fd_delta, delta, delta_len, 0) == delta_len);
+  close(fd_delta);
+
+  char *whole[] = {"vcdiff-partial", base_path, NULL};
+  CHECK(run_partial(whole, delta_path, delta, delta_len, 0, out_path) == 0);
+  CHECK(check_output(out_path, expected, len) == 0);
+
+  // a leading zero does not make the offset octal
+  char *range[] = {"vcdiff-partial", "--offset", "01000000", "--length",
+                   "3000000",        base_path,  NULL};
+  const uint8_t *slice = expected + RANGE_START;
+  for (int pipe_delta = 0; pipe_delta <= 1; pipe_delta++) {
+    CHECK(run_partial(range, delta_path, delta, delta_len, pipe_delta,
+                      out_path) == 0);
+    CHECK(check_output(out_path, slice, RANGE_LEN) == 0);
+  }
+
+  char *threads[] = {"vcdiff-partial", "--offset", "1000000", "--length",
+                     "3000000",        "--output", file_path, "--threads",
+                     "4",              base_path,  NULL};
+  CHECK(run_partial(threads, delta_path, delta, delta_len, 0, out_path) == 0);
+  CHECK(check_output(file_path, slice, RANGE_LEN) == 0);
+
+  // ranges are cut at the end of the target
+  char *tail[] = {"vcdiff-partial", "--offset", "1000000", "--output",
+                  file_path,        base_path,  NULL};
+  CHECK(run_partial(tail, delta_path, delta, delta_len, 0, out_path) == 0);
+  CHECK(check_output(file_path, slice, len - RANGE_START) == 0);
+  char *past[] = {"vcdiff-partial", "--offset", "1000000000", base_path, NULL};
+  CHECK(run_partial(past, delta_path, delta, delta_len, 0, out_path) == 0);
+  CHECK(check_output(out_path, expected, 0) == 0);
+
+  char *bad[] = {"vcdiff-partial", "--offset", "0x10", base_path, NULL};
+  CHECK(run_partial(bad, delta_path, delta, delta_len, 0, out_path) == 1);
+
+  unlink(file_path);
+  unlink(out_path);
+  unlink(delta_path);
+  unlink(base_path);
+  rmdir(dir);
+  free(delta);
+  free(expected);
+  free(base);
+  return 0;
+}
@@ -0,0 +1,182 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "patch_cache.h"
+#include "test_util.h"
+
+#define BASE_LEN (1 << 20)
+#define WINDOWS 32
+
+struct files {
+  int fd_base;
+  int fd_deltas[2];
+  uint8_t *expected[2];
+  size_t len[2];
+};
+
+static int acquire(struct patch_cache *cache, struct files *files, int i,
+                   struct patch_entry **entry) {
+  return patch_cache_acquire(cache, files->fd_base, 1, &files->fd_deltas[i],
+                             -1, entry);
+}
+
+static int check_entry(struct patch_entry *entry, struct files *files,
+                       int i) {
+  size_t len = files->len[i];
+  CHECK(entry->target.offset == len);
+  uint8_t *data = malloc(len);
+  CHECK(data != NULL);
+  int same = read_range(&entry->target, 0, len, data) == (int)len &&
+             memcmp(data, files->expected[i], len) == 0;
+  free(data);
+  CHECK(same);
+  return 0;
+}
+
+static size_t num_entries(struct patch_cache *cache) {
+  pthread_mutex_lock(&cache->lock);
+  size_t n = cache->num_entries;
+  pthread_mutex_unlock(&cache->lock);
+  return n;
+}
+
+// handles of one delta share its entry, which outlives them until it is
+// evicted, and a changed delta gets an entry of its own
+static int test_shared(struct files *files, size_t memory[2]) {
+  struct patch_cache cache;
+  CHECK(patch_cache_init(&cache, 60, SIZE_MAX, 0, 0) == 0);
+  struct patch_entry *first, *second;
+  CHECK(acquire(&cache, files, 0, &first) == 0);
+  CHECK(acquire(&cache, files, 0, &second) == 0);
+  CHECK(first == second && first->refcount == 2);
+  CHECK(check_entry(first, files, 0) == 0);
+  patch_cache_release(&cache, first);
+  patch_cache_release(&cache, second);
+  CHECK(cache.num_entries == 1 && cache.lru_head == first);
+  memory[0] = first->memory;
+
+  CHECK(acquire(&cache, files, 0, &second) == 0);
+  CHECK(second == first && cache.lru_head == NULL);
+  patch_cache_release(&cache, second);
+
+  CHECK(acquire(&cache, files, 1, &second) == 0);
+  CHECK(second != first && cache.num_entries == 2);
+  CHECK(check_entry(second, files, 1) == 0);
+  patch_cache_release(&cache, second);
+  memory[1] = second->memory;
+  CHECK(cache.memory == memory[0] + memory[1]);
+
+  struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = 1}};
+  CHECK(futimens(files->fd_deltas[0], times) == 0);
+  CHECK(acquire(&cache, files, 0, &second) == 0);
+  CHECK(cache.num_entries == 3);
+  CHECK(check_entry(second, files, 0) == 0);
+  patch_cache_release(&cache, second);
+  patch_cache_destroy(&cache);
+  return 0;
+}
+
+// released entries are dropped oldest first once the cache is over its
+// budget, at once without a timeout and by the reaper after it
+static int test_eviction(struct files *files, const size_t memory[2]) {
+  struct patch_cache cache;
+  size_t budget = memory[0] > memory[1] ? memory[0] : memory[1];
+  CHECK(patch_cache_init(&cache, 60, budget, 0, 0) == 0);
+  struct patch_entry *first, *second;
+  CHECK(acquire(&cache, files, 0, &first) == 0);
+  patch_cache_release(&cache, first);
+  CHECK(cache.num_entries == 1);
+  CHECK(acquire(&cache, files, 1, &second) == 0);
+  // the entry in use stays even though both do not fit
+  CHECK(cache.num_entries == 1 && cache.lru_head == NULL);
+  patch_cache_release(&cache, second);
+  CHECK(cache.num_entries == 1 && cache.lru_head == second);
+  patch_cache_destroy(&cache);
+
+  CHECK(patch_cache_init(&cache, 0, SIZE_MAX, 0, 0) == 0);
+  CHECK(acquire(&cache, files, 0, &first) == 0);
+  patch_cache_release(&cache, first);
+  CHECK(cache.num_entries == 0 && cache.memory == 0);
+  patch_cache_destroy(&cache);
+
+  CHECK(patch_cache_init(&cache, 1, SIZE_MAX, 0, 0) == 0);
+  CHECK(patch_cache_start(&cache) == 0);
+  CHECK(acquire(&cache, files, 0, &first) == 0);
+  patch_cache_release(&cache, first);
+  CHECK(num_entries(&cache) == 1);
+  struct timespec pause = {.tv_nsec = 100000000};
+  for (int i = 0; i < 50 && num_entries(&cache) > 0; i++)
+    nanosleep(&pause, NULL);
+  CHECK(num_entries(&cache) == 0);
+  patch_cache_destroy(&cache);
+  return 0;
+}
+
+// keys tell whether the page cache of a file can be kept, any change to the
+// delta or the base has to give another key
+static int test_keys(struct files *files) {
+  struct patch_key key, same, changed;
+  CHECK(patch_key_make(&key, files->fd_base, files->fd_deltas[1]) == 0);
+  CHECK(patch_key_make(&same, files->fd_base, files->fd_deltas[1]) == 0);
+  CHECK(patch_key_equal(&key, &same));
+  CHECK(patch_key_make(&changed, files->fd_base, files->fd_deltas[0]) == 0);
+  CHECK(!patch_key_equal(&key, &changed));
+
+  struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = 2}};
+  CHECK(futimens(files->fd_deltas[1], times) == 0);
+  CHECK(patch_key_make(&changed, files->fd_base, files->fd_deltas[1]) == 0);
+  CHECK(!patch_key_equal(&key, &changed));
+  CHECK(patch_key_make(&key, files->fd_base, files->fd_deltas[1]) == 0);
+  CHECK(futimens(files->fd_base, times) == 0);
+  CHECK(patch_key_make(&changed, files->fd_base, files->fd_deltas[1]) == 0);
+  CHECK(!patch_key_equal(&key, &changed));
+
+  // unpatched files have no base
+  CHECK(patch_key_make(&key, -1, files->fd_deltas[1]) == 0);
+  CHECK(patch_key_make(&same, -1, files->fd_deltas[1]) == 0);
+  CHECK(patch_key_equal(&key, &same));
+  return 0;
+}
+
+int main(void) {
+  char dir[64], base_path[96], delta_paths[2][96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_paths[0], dir, "delta0");
+  test_path(delta_paths[1], dir, "delta1");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  struct files files;
+  for (int i = 0; i < 2; i++) {
+    files.expected[i] = write_random_delta(delta_paths[i], base, BASE_LEN,
+                                           WINDOWS, 8 + i, &files.len[i]);
+    CHECK(files.expected[i] != NULL);
+    files.fd_deltas[i] = open(delta_paths[i], O_RDONLY);
+    CHECK(files.fd_deltas[i] >= 0);
+  }
+  files.fd_base = open(base_path, O_RDONLY);
+  CHECK(files.fd_base >= 0);
+
+  size_t memory[2];
+  CHECK(test_shared(&files, memory) == 0);
+  CHECK(test_eviction(&files, memory) == 0);
+  CHECK(test_keys(&files) == 0);
+
+  close(files.fd_base);
+  for (int i = 0; i < 2; i++) {
+    close(files.fd_deltas[i]);
+    unlink(delta_paths[i]);
+    free(files.expected[i]);
+  }
+  unlink(base_path);
+  rmdir(dir);
+  free(base);
+  return 0;
+}
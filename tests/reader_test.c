@@ -0,0 +1,101 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN ((1 << 20) + 1000)
+#define WINDOWS 128
+#define READS 300
+// less than the source pieces of most reads so they take several batches
+#define DEPTH 4
+
+// random ranges and the whole target read through the reader match what
+// read_range gives for them
+static int check_reads(struct target_stream *target, struct source_reader *reader,
+                       int fd_source, const uint8_t *expected, size_t len) {
+  uint8_t *data = malloc(len);
+  uint8_t *mapped = malloc(len);
+  CHECK(data != NULL && mapped != NULL);
+  struct read_cursor cursor = {0};
+  unsigned seed = 1;
+  int same = read_range_reader(target, &cursor, reader, fd_source, 0, len,
+                               data) == (int)len &&
+             memcmp(data, expected, len) == 0;
+  for (int i = 0; i < READS && same; i++) {
+    size_t offset = rand_r(&seed) % len;
+    size_t n = 1 + rand_r(&seed) % 200000;
+    if (n > len - offset)
+      n = len - offset;
+    same = read_range_reader(target, &cursor, reader, fd_source, offset, n,
+                             data) == (int)n &&
+           read_range(target, offset, n, mapped) == (int)n &&
+           memcmp(data, mapped, n) == 0;
+  }
+  free(mapped);
+  free(data);
+  CHECK(same);
+  return 0;
+}
+
+static int test_reader(struct target_stream *target, const char *base_path,
+                       int fd_base, int direct, const uint8_t *expected,
+                       size_t len) {
+  struct source_reader *reader;
+  int rc = source_reader_new(&reader, DEPTH, direct);
+  // without io_uring there is nothing but read_range_cursor to compare
+  if (rc == -ENOTSUP || rc == -ENOSYS || rc == -EPERM)
+    return 0;
+  CHECK(rc == 0);
+  // file systems without O_DIRECT still take the aligned reads
+  int fd = direct ? open(base_path, O_RDONLY | O_DIRECT) : -1;
+  rc = check_reads(target, reader, fd >= 0 ? fd : fd_base, expected, len);
+  if (fd >= 0)
+    close(fd);
+  source_reader_free(reader);
+  return rc;
+}
+
+// the base does not end on a block so direct reads of its end come back
+// short of the aligned length
+int main(void) {
+  char dir[64], base_path[96], delta_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_path, dir, "delta");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected =
+      write_random_delta(delta_path, base, BASE_LEN, WINDOWS, 6, &len);
+  CHECK(expected != NULL);
+  int fd_base = open(base_path, O_RDONLY);
+  int fd_delta = open(delta_path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff(&target, &source, fd_base, fd_delta) == 0);
+  CHECK(target.offset == len);
+  int rc = test_reader(&target, base_path, fd_base, 0, expected, len);
+  if (rc == 0)
+    rc = test_reader(&target, base_path, fd_base, 1, expected, len);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  close(fd_delta);
+  close(fd_base);
+  unlink(delta_path);
+  unlink(base_path);
+  rmdir(dir);
+  free(expected);
+  free(base);
+  return 0;
+}
@@ -0,0 +1,185 @@
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/wait.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN (16 << 20)
+// more than a window of the rebased diff
+#define WINDOWS 160
+// the windows of the rebased diff
+#define REBASE_WINDOW (4 << 20)
+#define INSERT_AT (5 << 20)
+#define INSERT_LEN 5000
+#define REMOVE_AT (11 << 20)
+#define REMOVE_LEN 4096
+
+extern char **environ;
+
+static const char *rebase_path;
+
+// runs vcdiff-rebase and returns its exit status
+static int run_rebase(char *const args[]) {
+  pid_t pid;
+  if (posix_spawn(&pid, rebase_path, NULL, NULL, args, environ) != 0)
+    return -1;
+  int status;
+  if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+// the rebased diff applied to the new base gives the target of the old one
+static int check_rebased(const char *new_path, const char *diff_path,
+                         const uint8_t *expected, size_t len) {
+  int fd_base = open(new_path, O_RDONLY);
+  int fd_delta = open(diff_path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+  struct target_stream target;
+  struct source_stream source;
+  int rc = load_diff(&target, &source, fd_base, fd_delta);
+  close(fd_delta);
+  close(fd_base);
+  CHECK(rc == 0);
+
+  uint8_t *data = malloc(len);
+  int same = data && target.offset == len &&
+             read_range(&target, 0, len, data) == (int)len &&
+             memcmp(data, expected, len) == 0;
+  free(data);
+  free_data(&target, &source);
+  CHECK(same);
+  return 0;
+}
+
+// the new base has a range inserted and, if remove is set, one removed, the
+// diff between the bases copies everything else from the old one
+static int write_new_base(const char *path, const char *diff_path,
+                          const uint8_t *old, int remove) {
+  uint8_t *inserted = random_data(INSERT_LEN, 5);
+  CHECK(inserted != NULL);
+  size_t tail = remove ? REMOVE_AT : BASE_LEN;
+  size_t rest = remove ? BASE_LEN - REMOVE_AT - REMOVE_LEN : 0;
+
+  FILE *file = fopen(path, "w");
+  CHECK(file != NULL);
+  fwrite(old, 1, INSERT_AT, file);
+  fwrite(inserted, 1, INSERT_LEN, file);
+  fwrite(old + INSERT_AT, 1, tail - INSERT_AT, file);
+  fwrite(old + REMOVE_AT + REMOVE_LEN, 1, rest, file);
+  CHECK(fclose(file) == 0);
+
+  struct delta_writer writer;
+  CHECK(delta_writer_open(&writer, diff_path, BASE_LEN) == 0);
+  int rc = delta_copy(&writer, 0, INSERT_AT);
+  if (rc >= 0)
+    rc = delta_add(&writer, inserted, INSERT_LEN);
+  if (rc >= 0)
+    rc = delta_copy(&writer, INSERT_AT, tail - INSERT_AT);
+  if (rc >= 0 && rest > 0)
+    rc = delta_copy(&writer, REMOVE_AT + REMOVE_LEN, rest);
+  if (rc >= 0)
+    rc = delta_end_window(&writer);
+  free(inserted);
+  CHECK(delta_writer_close(&writer) == 0 && rc >= 0);
+  return 0;
+}
+
+// the first window copies from before the removed range and is kept, the
+// second copies across it and is encoded again
+static uint8_t *write_split_diff(const char *path, const uint8_t *old,
+                                 size_t *len) {
+  static const size_t addresses[] = {0, REMOVE_AT - REBASE_WINDOW / 2};
+  uint8_t *target = malloc(2 * REBASE_WINDOW);
+  struct delta_writer writer;
+  if (target == NULL || delta_writer_open(&writer, path, BASE_LEN) < 0) {
+    free(target);
+    return NULL;
+  }
+  int rc = 0;
+  for (int i = 0; i < 2 && rc >= 0; i++) {
+    memcpy(target + i * REBASE_WINDOW, old + addresses[i], REBASE_WINDOW);
+    rc = delta_copy(&writer, addresses[i], REBASE_WINDOW);
+    if (rc >= 0)
+      rc = delta_end_window(&writer);
+  }
+  if (delta_writer_close(&writer) < 0 || rc < 0) {
+    free(target);
+    return NULL;
+  }
+  *len = 2 * REBASE_WINDOW;
+  return target;
+}
+
+// rebases the diff onto each new base, found through the diff between the
+// bases and by comparing at the same offsets, windows whose copies from the
+// old base broke are encoded again
+int main(int argc, char *argv[]) {
+  CHECK(argc == 2);
+  rebase_path = argv[1];
+
+  char dir[64], old_path[96], diff_path[96], split_path[96], new_path[96],
+      base_diff_path[96], out_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(old_path, dir, "old");
+  test_path(diff_path, dir, "diff");
+  test_path(split_path, dir, "split");
+  test_path(new_path, dir, "new");
+  test_path(base_diff_path, dir, "base_diff");
+  test_path(out_path, dir, "out");
+
+  uint8_t *old = random_data(BASE_LEN, 1);
+  CHECK(old != NULL);
+  CHECK(write_file(old_path, old, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected =
+      write_random_delta(diff_path, old, BASE_LEN, WINDOWS, 2, &len);
+  CHECK(expected != NULL);
+  size_t split_len;
+  uint8_t *split = write_split_diff(split_path, old, &split_len);
+  CHECK(split != NULL);
+
+  // an unchanged base keeps every copy
+  CHECK(write_file(new_path, old, BASE_LEN) == 0);
+  char *direct[] = {"vcdiff-rebase", old_path, new_path, "new", diff_path,
+                    out_path, NULL};
+  CHECK(run_rebase(direct) == 0);
+  CHECK(check_rebased(new_path, out_path, expected, len) == 0);
+
+  for (int remove = 0; remove <= 1; remove++) {
+    CHECK(write_new_base(new_path, base_diff_path, old, remove) == 0);
+    char *moved[] = {"vcdiff-rebase", "-d", base_diff_path, old_path,
+                     new_path, "new", diff_path, out_path, NULL};
+    CHECK(run_rebase(moved) == 0);
+    CHECK(check_rebased(new_path, out_path, expected, len) == 0);
+    CHECK(run_rebase(direct) == 0);
+    CHECK(check_rebased(new_path, out_path, expected, len) == 0);
+  }
+  char *partly[] = {"vcdiff-rebase", "-d", base_diff_path, old_path, new_path,
+                    "new", split_path, out_path, NULL};
+  CHECK(run_rebase(partly) == 0);
+  CHECK(check_rebased(new_path, out_path, split, split_len) == 0);
+
+  // a diff between the bases has to produce the new base
+  CHECK(write_file(new_path, old, BASE_LEN / 2) == 0);
+  char *mismatch[] = {"vcdiff-rebase", "-d", base_diff_path, old_path,
+                      new_path, "new", diff_path, out_path, NULL};
+  CHECK(run_rebase(mismatch) == 1);
+
+  unlink(out_path);
+  unlink(base_diff_path);
+  unlink(new_path);
+  unlink(split_path);
+  unlink(diff_path);
+  unlink(old_path);
+  rmdir(dir);
+  free(split);
+  free(expected);
+  free(old);
+  return 0;
+}
@@ -0,0 +1,162 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN (1 << 20)
+#define COPY_AT 100000
+#define COPY_LEN 10000
+#define ADD_LEN 5000
+#define FILL_ADD_LEN 64
+#define RUN_LEN 20000
+// shorter than a fill block, so it is kept as data
+#define SHORT_ADD_LEN 16
+#define NUM_SEGMENTS 5
+
+// a copy, an add, an add of one repeated byte, a run and a short add of one
+// repeated byte
+static uint8_t *write_delta(const char *path, const uint8_t *base,
+                            size_t *len) {
+  uint8_t *target = malloc(COPY_LEN + ADD_LEN + FILL_ADD_LEN + RUN_LEN +
+                           SHORT_ADD_LEN);
+  uint8_t *added = random_data(ADD_LEN, 2);
+  struct delta_writer writer;
+  if (target == NULL || added == NULL ||
+      delta_writer_open(&writer, path, BASE_LEN) < 0) {
+    free(added);
+    free(target);
+    return NULL;
+  }
+  uint8_t *pos = target;
+  memcpy(pos, base + COPY_AT, COPY_LEN);
+  int rc = delta_copy(&writer, COPY_AT, COPY_LEN);
+  pos += COPY_LEN;
+  memcpy(pos, added, ADD_LEN);
+  if (rc >= 0)
+    rc = delta_add(&writer, pos, ADD_LEN);
+  pos += ADD_LEN;
+  memset(pos, 'A', FILL_ADD_LEN);
+  if (rc >= 0)
+    rc = delta_add(&writer, pos, FILL_ADD_LEN);
+  pos += FILL_ADD_LEN;
+  memset(pos, 7, RUN_LEN);
+  if (rc >= 0)
+    rc = delta_run(&writer, 7, RUN_LEN);
+  pos += RUN_LEN;
+  memset(pos, 'B', SHORT_ADD_LEN);
+  if (rc >= 0)
+    rc = delta_add(&writer, pos, SHORT_ADD_LEN);
+  pos += SHORT_ADD_LEN;
+  if (rc >= 0)
+    rc = delta_end_window(&writer);
+  free(added);
+  if (delta_writer_close(&writer) < 0 || rc < 0) {
+    free(target);
+    return NULL;
+  }
+  *len = pos - target;
+  return target;
+}
+
+static int in_delta(const struct target_stream *target, const uint8_t *data,
+                    size_t len) {
+  return data >= target->delta_map &&
+         data + len <= target->delta_map + target->delta_len;
+}
+
+// copies can be read from the base file as well as its mapping, adds of one
+// repeated byte become fills like runs unless they are short, other adds
+// point into the delta if it is mapped and are copied otherwise
+static int check_segments(struct target_stream *target,
+                          const uint8_t *expected, size_t len, int mapped) {
+  struct segment segments[NUM_SEGMENTS + 1];
+  CHECK(map_range(target, 0, len, segments, NUM_SEGMENTS + 1) ==
+        NUM_SEGMENTS);
+  CHECK(segments[0].source_offset == COPY_AT &&
+        segments[0].len == COPY_LEN);
+  CHECK(segments[0].data == target->source_data + COPY_AT);
+  uint8_t copied[COPY_LEN];
+  CHECK(segments[0].fd >= 0 &&
+        pread(segments[0].fd, copied, COPY_LEN, COPY_AT) == COPY_LEN);
+  CHECK(memcmp(copied, expected, COPY_LEN) == 0);
+  for (int i = 1; i < NUM_SEGMENTS; i++)
+    CHECK(segments[i].fd == -1);
+  CHECK(segments[1].source_offset == SIZE_MAX && segments[1].data &&
+        segments[1].len == ADD_LEN);
+  CHECK(segments[2].data == NULL && segments[2].fill == 'A' &&
+        segments[2].len == FILL_ADD_LEN);
+  CHECK(segments[3].data == NULL && segments[3].fill == 7 &&
+        segments[3].len == RUN_LEN);
+  CHECK(segments[4].source_offset == SIZE_MAX && segments[4].data &&
+        segments[4].len == SHORT_ADD_LEN);
+  if (mapped) {
+    CHECK(target->delta_map != NULL);
+    CHECK(in_delta(target, segments[1].data, ADD_LEN));
+    CHECK(in_delta(target, segments[4].data, SHORT_ADD_LEN));
+    CHECK(target->mapped_len == ADD_LEN + SHORT_ADD_LEN);
+    CHECK(target->data_len == 0);
+  } else {
+    CHECK(target->delta_map == NULL && target->mapped_len == 0);
+    CHECK(target->data_len == ADD_LEN + SHORT_ADD_LEN);
+  }
+
+  uint8_t *data = malloc(len);
+  CHECK(data != NULL);
+  int same = read_range(target, 0, len, data) == (int)len &&
+             memcmp(data, expected, len) == 0;
+  free(data);
+  CHECK(same);
+  return 0;
+}
+
+int main(void) {
+  char dir[64], base_path[96], delta_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  test_path(delta_path, dir, "delta");
+
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+  size_t len;
+  uint8_t *expected = write_delta(delta_path, base, &len);
+  CHECK(expected != NULL);
+  int fd_base = open(base_path, O_RDONLY);
+  int fd_delta = open(delta_path, O_RDONLY);
+  CHECK(fd_base >= 0 && fd_delta >= 0);
+
+  struct target_stream target;
+  struct source_stream source;
+  CHECK(load_diff(&target, &source, fd_base, fd_delta) == 0);
+  int rc = check_segments(&target, expected, len, 1);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  // a delta that cannot be mapped is read into memory
+  off_t delta_len = lseek(fd_delta, 0, SEEK_END);
+  uint8_t delta[16384];
+  CHECK(delta_len <= (off_t)sizeof(delta));
+  CHECK(pread(fd_delta, delta, delta_len, 0) == delta_len);
+  int fds[2];
+  CHECK(pipe(fds) == 0);
+  CHECK(write(fds[1], delta, delta_len) == delta_len);
+  close(fds[1]);
+  rc = load_diff(&target, &source, fd_base, fds[0]);
+  close(fds[0]);
+  CHECK(rc == 0);
+  rc = check_segments(&target, expected, len, 0);
+  free_data(&target, &source);
+  CHECK(rc == 0);
+
+  close(fd_delta);
+  close(fd_base);
+  unlink(delta_path);
+  unlink(base_path);
+  rmdir(dir);
+  free(expected);
+  free(base);
+  return 0;
+}
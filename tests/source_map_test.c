@@ -0,0 +1,94 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "test_util.h"
+#include "vcdiff_incremental.h"
+
+#define BASE_LEN (1 << 20)
+#define THREADS 4
+#define ROUNDS 200
+
+struct mapper {
+  pthread_t thread;
+  const char *path;
+  const uint8_t *base;
+  int failed;
+};
+
+// maps and unmaps the base over and over while the other threads do the same
+static void *map_repeatedly(void *arg) {
+  struct mapper *mapper = arg;
+  int fd = open(mapper->path, O_RDONLY);
+  mapper->failed = fd < 0;
+  for (int i = 0; i < ROUNDS && !mapper->failed; i++) {
+    struct source_stream source = {0};
+    mapper->failed = map_source(&source, fd) < 0;
+    if (mapper->failed)
+      break;
+    size_t at = i * 4099 % BASE_LEN;
+    mapper->failed = source.len != BASE_LEN ||
+                     source.data[at] != mapper->base[at] ||
+                     unmap_source(&source) < 0;
+  }
+  if (fd >= 0)
+    close(fd);
+  return NULL;
+}
+
+// streams over the same file share one mapping, which outlives each of them
+// until the last is gone, a changed file is mapped anew
+int main(void) {
+  char dir[64], base_path[96];
+  CHECK(test_dir(dir) == 0);
+  test_path(base_path, dir, "base");
+  uint8_t *base = random_data(BASE_LEN, 1);
+  CHECK(base != NULL);
+  CHECK(write_file(base_path, base, BASE_LEN) == 0);
+
+  int fd_first = open(base_path, O_RDONLY);
+  int fd_second = open(base_path, O_RDONLY);
+  CHECK(fd_first >= 0 && fd_second >= 0);
+  struct source_stream first = {0}, second = {0}, changed = {0};
+  CHECK(map_source(&first, fd_first) == 0);
+  CHECK(map_source(&second, fd_second) == 0);
+  CHECK(first.data == second.data && first.fd == second.fd);
+  CHECK(first.len == BASE_LEN);
+  // the descriptor belongs to the mapping, not to the caller
+  CHECK(first.fd != fd_first && first.fd != fd_second);
+  close(fd_first);
+
+  CHECK(unmap_source(&first) == 0);
+  CHECK(memcmp(second.data, base, BASE_LEN) == 0);
+
+  struct timespec times[2] = {{.tv_nsec = UTIME_OMIT}, {.tv_sec = 1}};
+  CHECK(futimens(fd_second, times) == 0);
+  CHECK(map_source(&changed, fd_second) == 0);
+  CHECK(changed.data != second.data);
+  CHECK(memcmp(changed.data, base, BASE_LEN) == 0);
+  CHECK(unmap_source(&changed) == 0);
+  CHECK(unmap_source(&second) == 0);
+  close(fd_second);
+
+  struct mapper mappers[THREADS];
+  for (int i = 0; i < THREADS; i++) {
+    mappers[i] = (struct mapper){.path = base_path, .base = base};
+    CHECK(pthread_create(&mappers[i].thread, NULL, map_repeatedly,
+                         &mappers[i]) == 0);
+  }
+  int failed = 0;
+  for (int i = 0; i < THREADS; i++) {
+    pthread_join(mappers[i].thread, NULL);
+    failed |= mappers[i].failed;
+  }
+  CHECK(!failed);
+
+  unlink(base_path);
+  rmdir(dir);
+  free(base);
+  return 0;
+}
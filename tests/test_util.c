@@ -0,0 +1,197 @@
+#include "test_util.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define OP_RUN 0
+#define OP_ADD 1
+#define OP_COPY 19
+
+static size_t put_varint(uint8_t *dest, size_t value) {
+  uint8_t buf[10];
+  size_t len = 0;
+  do {
+    buf[len++] = value & 0x7f;
+    value >>= 7;
+  } while (value);
+  for (size_t i = 0; i < len; i++)
+    dest[i] = buf[len - 1 - i] | (i + 1 < len ? 0x80 : 0);
+  return len;
+}
+
+static uint8_t *reserve(struct delta_writer *writer, size_t len) {
+  if (writer->capacity - writer->inst_len < len) {
+    size_t capacity = 2 * writer->capacity + len;
+    uint8_t *inst = realloc(writer->inst, capacity);
+    if (inst == NULL)
+      return NULL;
+    writer->inst = inst;
+    writer->capacity = capacity;
+  }
+  return writer->inst + writer->inst_len;
+}
+
+int delta_writer_open(struct delta_writer writer[static 1], const char *path,
+                      size_t source_len) {
+  static const uint8_t header[] = {0xd6, 0xc3, 0xc4, 'S', 0x00};
+  *writer = (struct delta_writer){.source_len = source_len};
+  writer->file = fopen(path, "wb");
+  if (writer->file == NULL)
+    return -errno;
+  if (fwrite(header, sizeof(header), 1, writer->file) != 1)
+    return -EIO;
+  return 0;
+}
+
+int delta_copy(struct delta_writer writer[static 1], size_t address,
+               size_t len) {
+  uint8_t *inst = reserve(writer, 21);
+  if (inst == NULL)
+    return -ENOMEM;
+  uint8_t *start = inst;
+  *inst++ = OP_COPY;
+  inst += put_varint(inst, len);
+  inst += put_varint(inst, address);
+  writer->inst_len += inst - start;
+  writer->target_len += len;
+  return 0;
+}
+
+int delta_add(struct delta_writer writer[static 1], const uint8_t *data,
+              size_t len) {
+  uint8_t *inst = reserve(writer, 11 + len);
+  if (inst == NULL)
+    return -ENOMEM;
+  uint8_t *start = inst;
+  *inst++ = OP_ADD;
+  inst += put_varint(inst, len);
+  memcpy(inst, data, len);
+  inst += len;
+  writer->inst_len += inst - start;
+  writer->target_len += len;
+  return 0;
+}
+
+int delta_run(struct delta_writer writer[static 1], uint8_t byte, size_t len) {
+  uint8_t *inst = reserve(writer, 12);
+  if (inst == NULL)
+    return -ENOMEM;
+  uint8_t *start = inst;
+  *inst++ = OP_RUN;
+  inst += put_varint(inst, len);
+  *inst++ = byte;
+  writer->inst_len += inst - start;
+  writer->target_len += len;
+  return 0;
+}
+
+int delta_end_window(struct delta_writer writer[static 1]) {
+  uint8_t encoding[32];
+  size_t encoding_len = put_varint(encoding, writer->target_len);
+  encoding[encoding_len++] = 0;
+  encoding_len += put_varint(encoding + encoding_len, 0);
+  encoding_len += put_varint(encoding + encoding_len, writer->inst_len);
+  encoding_len += put_varint(encoding + encoding_len, 0);
+
+  uint8_t header[32];
+  size_t header_len = 0;
+  header[header_len++] = writer->source_len > 0;
+  if (writer->source_len > 0) {
+    header_len += put_varint(header + header_len, writer->source_len);
+    header_len += put_varint(header + header_len, 0);
+  }
+  header_len += put_varint(header + header_len, encoding_len + writer->inst_len);
+
+  if (fwrite(header, header_len, 1, writer->file) != 1 ||
+      fwrite(encoding, encoding_len, 1, writer->file) != 1 ||
+      (writer->inst_len > 0 &&
+       fwrite(writer->inst, writer->inst_len, 1, writer->file) != 1))
+    return -EIO;
+  writer->inst_len = 0;
+  writer->target_len = 0;
+  return 0;
+}
+
+int delta_writer_close(struct delta_writer writer[static 1]) {
+  free(writer->inst);
+  return fclose(writer->file) == 0 ? 0 : -errno;
+}
+
+#define WINDOW_LEN (64 * 1024)
+
+uint8_t *write_random_delta(const char *path, const uint8_t *source,
+                            size_t source_len, size_t num_windows,
+                            unsigned seed, size_t *target_len) {
+  uint8_t *target = malloc(num_windows * WINDOW_LEN);
+  struct delta_writer writer;
+  if (target == NULL || delta_writer_open(&writer, path, source_len) < 0) {
+    free(target);
+    return NULL;
+  }
+  srand(seed);
+  size_t len = 0;
+  int rc = 0;
+  for (size_t window = 0; window < num_windows && rc >= 0; window++) {
+    size_t window_end = len + WINDOW_LEN - rand() % 1024;
+    while (len < window_end && rc >= 0) {
+      size_t n = 1 + rand() % 4096;
+      if (n > window_end - len)
+        n = window_end - len;
+      int type = rand() % 4;
+      if (type < 2 && n <= source_len) {
+        size_t address = rand() % (source_len - n + 1);
+        memcpy(target + len, source + address, n);
+        rc = delta_copy(&writer, address, n);
+      } else if (type == 2) {
+        for (size_t i = 0; i < n; i++)
+          target[len + i] = rand();
+        rc = delta_add(&writer, target + len, n);
+      } else {
+        memset(target + len, rand(), n);
+        rc = delta_run(&writer, target[len], n);
+      }
+      len += n;
+    }
+    if (rc >= 0)
+      rc = delta_end_window(&writer);
+  }
+  if (delta_writer_close(&writer) < 0 || rc < 0) {
+    free(target);
+    return NULL;
+  }
+  *target_len = len;
+  return target;
+}
+
+uint8_t *random_data(size_t len, unsigned seed) {
+  uint8_t *data = malloc(len);
+  if (data == NULL)
+    return NULL;
+  srand(seed);
+  for (size_t i = 0; i < len; i++)
+    data[i] = rand();
+  return data;
+}
+
+int test_dir(char dir[static 64]) {
+  const char *tmp = getenv("TMPDIR");
+  snprintf(dir, 64, "%s/patchfs-test-XXXXXX", tmp ? tmp : "/tmp");
+  return mkdtemp(dir) ? 0 : -errno;
+}
+
+void test_path(char path[static 96], const char dir[static 64],
+               const char *name) {
+  snprintf(path, 96, "%s/%s", dir, name);
+}
+
+int write_file(const char *path, const uint8_t *data, size_t len) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+    return -errno;
+  int rc = len == 0 || fwrite(data, len, 1, file) == 1 ? 0 : -EIO;
+  if (fclose(file) != 0 && rc == 0)
+    rc = -errno;
+  return rc;
+}
@@ -0,0 +1,60 @@
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__,       \
+              #cond);                                                          \
+      return 1;                                                                \
+    }                                                                          \
+  } while (0)
+
+// writes deltas in the interleaved format of the encoder, one instruction
+// per call, windows are ended explicitly
+struct delta_writer {
+  FILE *file;
+  size_t source_len;
+  uint8_t *inst;
+  size_t inst_len;
+  size_t capacity;
+  size_t target_len;
+};
+
+int delta_writer_open(struct delta_writer writer[static 1], const char *path,
+                      size_t source_len);
+
+int delta_copy(struct delta_writer writer[static 1], size_t address,
+               size_t len);
+
+int delta_add(struct delta_writer writer[static 1], const uint8_t *data,
+              size_t len);
+
+int delta_run(struct delta_writer writer[static 1], uint8_t byte, size_t len);
+
+int delta_end_window(struct delta_writer writer[static 1]);
+
+int delta_writer_close(struct delta_writer writer[static 1]);
+
+// a delta of random copies, adds and runs in windows of up to 64 KiB, the
+// target is returned and has to be freed
+uint8_t *write_random_delta(const char *path, const uint8_t *source,
+                            size_t source_len, size_t num_windows,
+                            unsigned seed, size_t *target_len);
+
+uint8_t *random_data(size_t len, unsigned seed);
+
+// creates a directory for the files of a test, paths in it are built with
+// test_path
+int test_dir(char dir[static 64]);
+
+void test_path(char path[static 96], const char dir[static 64],
+               const char *name);
+
+// writes len bytes of data to a new file at path
+int write_file(const char *path, const uint8_t *data, size_t len);
+#endif
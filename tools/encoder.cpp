@@ -1,55 +1,167 @@
-#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <cstring>
+#include <filesystem>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "fcntl.h"
 #include "sys/mman.h"
 #include "sys/stat.h"
+#include "sys/uio.h"
 #include "sys/xattr.h"
+#include "unistd.h"
 
 #include "google/vcencoder.h"
 
-#define BUFSIZE 4 * 1024 * 1024
+#define BUFSIZE (4 * 1024 * 1024)
+#define MAX_THREADS 256
 
+// permissions of new deltas, 0666 less the umask as open would give them
+static mode_t output_mode;
+
+// files are written next to their destination and renamed over it once they
+// are complete, so a mount never sees a partial file or the xattrs of the
+// one it replaces, and a failed write leaves the old file in place
+static int CreateTemp(const std::string &path, std::string &temp,
+                      mode_t mode) {
+  temp = path + ".XXXXXX";
+  int fd = mkstemp(temp.data());
+  if (fd >= 0 && fchmod(fd, mode) < 0) {
+    int error = errno;
+    close(fd);
+    unlink(temp.c_str());
+    errno = error;
+    return -1;
+  }
+  return fd;
+}
+
+// closes fd and moves temp over path, temp is removed if that fails
+static bool CommitTemp(int fd, const std::string &temp,
+                       const std::string &path) {
+  bool ok = fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+  if (!ok) {
+    int error = errno;
+    unlink(temp.c_str());
+    errno = error;
+  }
+  return ok;
+}
+
+// output is collected in an aligned buffer and written in whole buffers,
+// appends large enough to fill it are written in place along with it
 class FileOutput : public open_vcdiff::OutputStringInterface {
-  FILE *file_;
+  static constexpr size_t kBufferSize = 1024 * 1024;
+  static constexpr size_t kAlign = 4096;
+
+  std::string path_, temp_;
+  int fd_;
+  char *buffer_;
+  size_t used_ = 0;
+  // bytes in the file, the buffer follows them
+  off_t written_ = 0;
+
+  void Write(struct iovec *iov, int count) {
+    while (count > 0) {
+      ssize_t n = pwritev(fd_, iov, count, written_);
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error(
+            std::string("Failed to write to output file: ") +
+            strerror(errno));
+      }
+      written_ += n;
+      for (; count > 0 && static_cast<size_t>(n) >= iov->iov_len;
+           iov++, count--)
+        n -= iov->iov_len;
+      if (count > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+        iov->iov_len -= n;
+      }
+    }
+  }
 
 public:
-  FileOutput(const std::string &path) {
-    file_ = fopen(path.c_str(), "wb");
-    if (file_ == NULL)
-      throw std::runtime_error("Failed to open output file");
+  FileOutput(const std::string &path, mode_t mode) : path_(path) {
+    fd_ = CreateTemp(path, temp_, mode);
+    if (fd_ < 0)
+      throw std::runtime_error(std::string("Failed to create output file: ") +
+                               strerror(errno));
+    buffer_ = static_cast<char *>(std::aligned_alloc(kAlign, kBufferSize));
+    if (buffer_ == NULL) {
+      ::close(fd_);
+      unlink(temp_.c_str());
+      throw std::bad_alloc();
+    }
   }
 
-  ~FileOutput() { fclose(file_); }
+  // an output that was not closed is dropped, the destination is untouched
+  ~FileOutput() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+      unlink(temp_.c_str());
+    }
+    free(buffer_);
+  }
 
   OutputStringInterface &append(const char *s, size_t n) {
-    if (fwrite(s, n, 1, file_) < 0)
-      throw std::runtime_error("Failed to write to output file");
+    if (used_ + n < kBufferSize) {
+      memcpy(buffer_ + used_, s, n);
+      used_ += n;
+      return *this;
+    }
+
+    // the buffer and the part of s up to the last buffer boundary go out in
+    // one call, the rest starts the next buffer
+    size_t direct = (used_ + n) / kBufferSize * kBufferSize - used_;
+    struct iovec iov[2] = {{buffer_, used_}, {const_cast<char *>(s), direct}};
+    Write(iov, 2);
+    used_ = n - direct;
+    memcpy(buffer_, s + direct, used_);
     return *this;
   }
 
   void clear() {}
 
-  void push_back(char c) {
-    if (fputc(c, file_) < 0)
-      throw std::runtime_error("Failed to write to output file");
-  }
+  void push_back(char c) { append(&c, 1); }
+
+  void ReserveAdditionalBytes(size_t) {}
 
-  void ReserveAdditionalBytes(size_t res_arg) {}
+  size_t size() const { return written_ + used_; }
 
-  size_t size() const { return ftell(file_); }
+  // writes what is left in the buffer and replaces the destination with the
+  // output, errors are only reported here
+  void Close() {
+    struct iovec iov = {buffer_, used_};
+    Write(&iov, 1);
+    used_ = 0;
+    int fd = fd_;
+    fd_ = -1;
+    if (!CommitTemp(fd, temp_, path_))
+      throw std::runtime_error(
+          std::string("Failed to close output file: ") + strerror(errno));
+  }
 
   void SetXAttr(const std::string &diffSourcePath, size_t diffSourceSize) {
-    int fd = fileno(file_);
-    if (fsetxattr(fd, "user.diff_src", diffSourcePath.c_str(),
+    if (fsetxattr(fd_, "user.diff_src", diffSourcePath.c_str(),
                   diffSourcePath.size(), 0) < 0)
       throw std::runtime_error(
           std::string("Failed to set xattr user.diff_src: ") + strerror(errno));
     std::string str_size = std::to_string(diffSourceSize);
-    if (fsetxattr(fd, "user.diff_src_size", str_size.c_str(), str_size.size(),
+    if (fsetxattr(fd_, "user.diff_src_size", str_size.c_str(), str_size.size(),
                   0) < 0)
       throw std::runtime_error(
           std::string("Failed to set xattr user.diff_src_size: ") +
@@ -57,13 +169,330 @@ public:
   }
 };
 
-int main(int argc, char *argv[]) {
-  if (argc != 5) {
-    std::cerr << "Usage: " << argv[0] << " [OLD] [DIFF] [OLD_PATH] [NEW]"
+// encodes the target in windows of BUFSIZE on several threads against the
+// shared dictionary, windows are self-contained so encoding each with its own
+// encoder and dropping all but the first header gives a valid delta
+class ParallelEncoder {
+  const open_vcdiff::HashedDictionary &dictionary_;
+  const char *data_;
+  size_t size_;
+  size_t num_windows_;
+  // windows encoded ahead of the writer are bounded by this
+  size_t max_pending_;
+
+  std::mutex lock_;
+  std::condition_variable changed_;
+  size_t next_ = 0;
+  size_t written_ = 0;
+  std::map<size_t, std::string> finished_;
+  bool failed_ = false;
+
+  // the window is encoded straight from the mapped target
+  bool EncodeWindow(size_t window, std::string &out) {
+    size_t offset = window * BUFSIZE;
+    size_t len = std::min<size_t>(BUFSIZE, size_ - offset);
+    open_vcdiff::VCDiffStreamingEncoder encoder(
+        &dictionary_, open_vcdiff::VCD_FORMAT_INTERLEAVED, false);
+    std::string header;
+    return encoder.StartEncoding(&header) &&
+           encoder.EncodeChunk(data_ + offset, len, &out) &&
+           encoder.FinishEncoding(&out);
+  }
+
+  void Work() {
+    for (;;) {
+      size_t window;
+      {
+        std::unique_lock<std::mutex> lock(lock_);
+        changed_.wait(lock, [&] {
+          return failed_ || next_ >= num_windows_ ||
+                 next_ < written_ + max_pending_;
+        });
+        if (failed_ || next_ >= num_windows_)
+          return;
+        window = next_++;
+      }
+
+      std::string out;
+      bool ok = EncodeWindow(window, out);
+      {
+        std::lock_guard<std::mutex> lock(lock_);
+        if (ok)
+          finished_.emplace(window, std::move(out));
+        else
+          failed_ = true;
+      }
+      changed_.notify_all();
+    }
+  }
+
+public:
+  ParallelEncoder(const open_vcdiff::HashedDictionary &dictionary,
+                  const char *data, size_t size, unsigned threads)
+      : dictionary_(dictionary), data_(data), size_(size),
+        num_windows_((size + BUFSIZE - 1) / BUFSIZE),
+        max_pending_(2 * threads) {}
+
+  // writes the header and then each window as soon as it and all before it
+  // are finished
+  bool Encode(FileOutput &delta, unsigned threads) {
+    open_vcdiff::VCDiffStreamingEncoder encoder(
+        &dictionary_, open_vcdiff::VCD_FORMAT_INTERLEAVED, false);
+    if (!encoder.StartEncodingToInterface(&delta))
+      return false;
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < threads; i++)
+      workers.emplace_back(&ParallelEncoder::Work, this);
+
+    std::unique_lock<std::mutex> lock(lock_);
+    while (written_ < num_windows_) {
+      changed_.wait(lock, [&] { return failed_ || finished_.count(written_); });
+      if (failed_)
+        break;
+      auto window = finished_.extract(written_);
+      lock.unlock();
+      try {
+        delta.append(window.mapped().data(), window.mapped().size());
+      } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        lock.lock();
+        failed_ = true;
+        break;
+      }
+      lock.lock();
+      written_++;
+      changed_.notify_all();
+    }
+    lock.unlock();
+    changed_.notify_all();
+
+    for (auto &worker : workers)
+      worker.join();
+    return !failed_;
+  }
+};
+
+// maps a whole file for reading in order, empty files map to nothing
+static const char *MapFile(int fd, size_t size) {
+  if (size == 0)
+    return "";
+  void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED)
+    return NULL;
+  madvise(data, size, MADV_SEQUENTIAL);
+  return static_cast<const char *>(data);
+}
+
+static void UnmapFile(const char *data, size_t size) {
+  if (size > 0)
+    munmap(const_cast<char *>(data), size);
+}
+
+// replaces path with a plain copy of fd, without the xattrs of a delta
+static bool CopyFile(int fd, const std::filesystem::path &path, mode_t mode) {
+  std::string temp;
+  int out_fd = CreateTemp(path, temp, mode);
+  if (out_fd < 0)
+    return false;
+
+  off_t offset = 0;
+  ssize_t n;
+  while ((n = copy_file_range(fd, &offset, out_fd, NULL, BUFSIZE, 0)) > 0)
+    ;
+  // older kernels cannot copy across filesystems
+  if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS)) {
+    std::vector<char> buf(BUFSIZE);
+    while ((n = pread(fd, buf.data(), BUFSIZE, offset)) > 0) {
+      if (write(out_fd, buf.data(), n) != n) {
+        n = -1;
+        break;
+      }
+      offset += n;
+    }
+  }
+  if (n != 0) {
+    close(out_fd);
+    unlink(temp.c_str());
+    return false;
+  }
+  return CommitTemp(out_fd, temp, path);
+}
+
+struct BatchStats {
+  std::atomic<size_t> encoded{0}, copied{0}, failed{0};
+  std::atomic<uint64_t> bytes{0};
+};
+
+// encodes new_path to diff_path, or copies it if the delta is not smaller
+static bool EncodeTarget(const open_vcdiff::HashedDictionary &dictionary,
+                         const char *old_path,
+                         const std::filesystem::path &new_path,
+                         const std::filesystem::path &diff_path,
+                         BatchStats &stats) {
+  int new_fd = open(new_path.c_str(), O_RDONLY);
+  struct stat new_stat;
+  if (new_fd < 0 || fstat(new_fd, &new_stat) < 0) {
+    std::cerr << "Failed to open " << new_path << ": " << strerror(errno)
               << std::endl;
+    if (new_fd >= 0)
+      close(new_fd);
+    return false;
+  }
+
+  const char *new_data = MapFile(new_fd, new_stat.st_size);
+  if (new_data == NULL) {
+    std::cerr << "Failed to mmap " << new_path << ": " << strerror(errno)
+              << std::endl;
+    close(new_fd);
+    return false;
+  }
+
+  bool ok = false;
+  try {
+    std::filesystem::create_directories(diff_path.parent_path());
+    bool smaller;
+    {
+      // dropped unless it turns out smaller than the file
+      FileOutput delta(diff_path, output_mode);
+      ParallelEncoder encoder(dictionary, new_data, new_stat.st_size, 1);
+      ok = encoder.Encode(delta, 1);
+      smaller = ok && delta.size() < static_cast<size_t>(new_stat.st_size);
+      if (smaller) {
+        delta.SetXAttr(old_path, new_stat.st_size);
+        delta.Close();
+      }
+    }
+    if (ok && !smaller)
+      ok = CopyFile(new_fd, diff_path, new_stat.st_mode & 07777);
+    if (ok)
+      (smaller ? stats.encoded : stats.copied)++;
+  } catch (const std::exception &e) {
+    std::cerr << diff_path << ": " << e.what() << std::endl;
+    ok = false;
+  }
+  if (!ok)
+    std::cerr << "Failed to encode " << new_path << std::endl;
+  else
+    stats.bytes += new_stat.st_size;
+  UnmapFile(new_data, new_stat.st_size);
+  close(new_fd);
+  return ok;
+}
+
+// relative and without .. components, so it stays below any directory
+static bool IsContainedPath(const std::filesystem::path &path) {
+  if (path.has_root_path())
+    return false;
+  for (const auto &component : path)
+    if (component == "..")
+      return false;
+  return true;
+}
+
+// targets are the regular files below new_dir, or the paths listed on stdin
+// if it is "-", each is written to the same relative path below diff_dir
+static int EncodeBatch(const open_vcdiff::HashedDictionary &dictionary,
+                       const char *old_path, const char *new_dir,
+                       const char *diff_dir, unsigned threads) {
+  std::vector<std::filesystem::path> targets;
+  try {
+    if (strcmp(new_dir, "-") == 0) {
+      std::string line;
+      while (std::getline(std::cin, line)) {
+        if (line.empty())
+          continue;
+        // the path is reused below diff_dir and must not lead out of it
+        std::filesystem::path target(line);
+        if (!IsContainedPath(target)) {
+          std::cerr << "Refusing path outside of the diff directory: "
+                    << target << std::endl;
+          return 1;
+        }
+        targets.push_back(std::move(target));
+      }
+    } else {
+      for (const auto &entry :
+           std::filesystem::recursive_directory_iterator(new_dir))
+        if (entry.is_regular_file() && !entry.is_symlink())
+          targets.push_back(entry.path());
+    }
+  } catch (const std::exception &e) {
+    std::cerr << e.what() << std::endl;
     return 1;
   }
 
+  BatchStats stats;
+  std::atomic<size_t> next{0};
+  auto start = std::chrono::steady_clock::now();
+  auto work = [&] {
+    for (size_t i; (i = next++) < targets.size();) {
+      const std::filesystem::path &target = targets[i];
+      std::filesystem::path relative =
+          strcmp(new_dir, "-") == 0 ? target
+                                    : target.lexically_relative(new_dir);
+      if (!EncodeTarget(dictionary, old_path, target,
+                        std::filesystem::path(diff_dir) / relative, stats))
+        stats.failed++;
+    }
+  };
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; i++)
+    workers.emplace_back(work);
+  work();
+  for (auto &worker : workers)
+    worker.join();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  double mib = static_cast<double>(stats.bytes.load()) / (1024.0 * 1024.0);
+  std::cerr << "Encoded " << stats.encoded << " files, copied " << stats.copied
+            << " that did not shrink, " << stats.failed << " failed, "
+            << mib << " MiB in " << elapsed.count() << " s ("
+            << mib / elapsed.count() << " MiB/s, " << threads << " threads)"
+            << std::endl;
+  return stats.failed ? 1 : 0;
+}
+
+static bool ParseThreads(const char *arg, unsigned &threads) {
+  char *end;
+  errno = 0;
+  unsigned long value = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || value == 0 ||
+      value > MAX_THREADS)
+    return false;
+  threads = static_cast<unsigned>(value);
+  return true;
+}
+
+static int usage(const char *progname) {
+  std::cerr << "Usage: " << progname
+            << " [-t THREADS] [OLD] [DIFF] [OLD_PATH] [NEW]\n"
+            << "       " << progname
+            << " -b [-t THREADS] [OLD] [OLD_PATH] [NEW_DIR|-] [DIFF_DIR]"
+            << std::endl;
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  unsigned threads = 1;
+  bool batch = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "bt:")) != -1) {
+    if (opt == 'b')
+      batch = true;
+    else if (opt != 't' || !ParseThreads(optarg, threads))
+      return usage(argv[0]);
+  }
+  if (argc - optind != 4)
+    return usage(argv[0]);
+  // read before any threads run, umask can only be read by setting it
+  mode_t mask = umask(0);
+  umask(mask);
+  output_mode = 0666 & ~mask;
+  // the positional arguments keep their indexes
+  argv += optind - 1;
+
   // mmap the input file
   int input_fd = open(argv[1], O_RDONLY);
   if (input_fd < 0) {
@@ -77,41 +506,49 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  char *input_data = (char *)mmap(NULL, input_stat.st_size, PROT_READ,
-                                  MAP_PRIVATE, input_fd, 0);
+  char *input_data = static_cast<char *>(
+      mmap(NULL, input_stat.st_size, PROT_READ, MAP_PRIVATE, input_fd, 0));
   if (input_data == MAP_FAILED) {
     std::cerr << "Failed to mmap input file" << std::endl;
     return 1;
   }
 
-  FILE *new_file = fopen(argv[4], "rb");
-
   open_vcdiff::HashedDictionary dictionary(input_data, input_stat.st_size,
                                            false);
   dictionary.Init();
 
-  open_vcdiff::VCDiffStreamingEncoder encoder(
-      &dictionary, open_vcdiff::VCD_FORMAT_INTERLEAVED, false);
-
-  FileOutput delta(argv[2]);
+  // the dictionary is built once and shared by all targets of a batch
+  if (batch)
+    return EncodeBatch(dictionary, argv[2], argv[3], argv[4], threads);
 
-  if (!encoder.StartEncodingToInterface(&delta))
+  int new_fd = open(argv[4], O_RDONLY);
+  struct stat new_stat;
+  if (new_fd < 0 || fstat(new_fd, &new_stat) < 0) {
+    std::cerr << "Failed to open new file" << std::endl;
     return 1;
-  char *buf = new char[BUFSIZE];
-  size_t len;
-  while ((len = fread(buf, 1, BUFSIZE, new_file)) > 0) {
-    if (!encoder.EncodeChunkToInterface(buf, len, &delta)) {
-      delete[] buf;
-      return 1;
-    }
   }
-  if (!encoder.FinishEncodingToInterface(&delta)) {
-    delete[] buf;
+  const char *new_data = MapFile(new_fd, new_stat.st_size);
+  if (new_data == NULL) {
+    std::cerr << "Failed to mmap new file" << std::endl;
     return 1;
   }
 
-  delta.SetXAttr(argv[3], ftell(new_file));
+  FileOutput delta(argv[2], output_mode);
+
+  auto start = std::chrono::steady_clock::now();
+  ParallelEncoder encoder(dictionary, new_data, new_stat.st_size, threads);
+  if (!encoder.Encode(delta, threads)) {
+    std::cerr << "Failed to encode " << argv[4] << std::endl;
+    return 1;
+  }
+  delta.SetXAttr(argv[3], new_stat.st_size);
+  delta.Close();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
 
-  delete[] buf;
+  double mib = static_cast<double>(new_stat.st_size) / (1024.0 * 1024.0);
+  std::cerr << "Encoded " << mib << " MiB in " << elapsed.count() << " s ("
+            << mib / elapsed.count() << " MiB/s, " << threads << " threads)"
+            << std::endl;
   return 0;
 }
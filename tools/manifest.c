@@ -0,0 +1,255 @@
+#include "manifest.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#define INITIAL_BUCKETS 64
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t hash_bytes(uint64_t h, const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    h ^= (uint8_t)data[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+static size_t padded_len(size_t len) { return (len + 7) & ~(size_t)7; }
+
+static int write_all(int fd, const void *data, size_t len) {
+  const uint8_t *pos = data;
+  while (len > 0) {
+    ssize_t written = write(fd, pos, len);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    pos += written;
+    len -= written;
+  }
+  return 0;
+}
+
+// records are collected in memory since the header needs their count
+struct builder {
+  uint8_t *data;
+  size_t len;
+  size_t capacity;
+  uint64_t num_records;
+};
+
+static int append(struct builder *builder, const void *data, size_t len) {
+  if (builder->len + len > builder->capacity) {
+    size_t capacity = 2 * builder->capacity + len;
+    uint8_t *grown = realloc(builder->data, capacity);
+    if (grown == NULL)
+      return -ENOMEM;
+    builder->data = grown;
+    builder->capacity = capacity;
+  }
+  memcpy(builder->data + builder->len, data, len);
+  builder->len += len;
+  return 0;
+}
+
+static int add_file(struct builder *builder, const char *path,
+                    const char *rel_path, const struct stat *st) {
+  char src_size[32];
+  ssize_t length = lgetxattr(path, "user.diff_src_size", src_size, 31);
+  if (length < 0)
+    return errno == ENODATA ? 0 : -errno;
+  src_size[length] = '\0';
+
+  size_t path_len = strlen(rel_path);
+  struct manifest_record record = {.delta_size = st->st_size,
+                                   .ctime_sec = st->st_ctim.tv_sec,
+                                   .ctime_nsec = st->st_ctim.tv_nsec,
+                                   .target_size =
+                                       strtoull(src_size, NULL, 10),
+                                   .path_len = path_len};
+  static const char padding[8];
+  int rc = append(builder, &record, sizeof(record));
+  if (rc == 0)
+    rc = append(builder, rel_path, path_len);
+  if (rc == 0)
+    rc = append(builder, padding, padded_len(path_len) - path_len);
+  builder->num_records++;
+  return rc;
+}
+
+// path holds the directory, rel_path points at its part below the top
+static int add_dir(struct builder *builder, char path[static PATH_MAX],
+                   size_t len, const char *rel_path) {
+  DIR *dp = opendir(path);
+  if (dp == NULL)
+    return -errno;
+
+  int rc = 0;
+  struct dirent *de;
+  while (rc == 0 && (de = readdir(dp)) != NULL) {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    size_t name_len = strlen(de->d_name);
+    if (len + 1 + name_len >= PATH_MAX) {
+      rc = -ENAMETOOLONG;
+      break;
+    }
+    path[len] = '/';
+    memcpy(path + len + 1, de->d_name, name_len + 1);
+
+    struct stat st;
+    if (lstat(path, &st) < 0)
+      rc = -errno;
+    else if (S_ISDIR(st.st_mode))
+      rc = add_dir(builder, path, len + 1 + name_len, rel_path);
+    else if (S_ISREG(st.st_mode))
+      rc = add_file(builder, path, rel_path, &st);
+  }
+  path[len] = '\0';
+  closedir(dp);
+  return rc;
+}
+
+int manifest_build(const char *dir, int fd_manifest) {
+  struct manifest_header header = {.magic = MANIFEST_MAGIC};
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  // file timestamps come from a coarse clock that may lag behind
+  header.built_sec = now.tv_sec - 1;
+  header.built_nsec = now.tv_nsec;
+
+  char path[PATH_MAX];
+  size_t len = strlen(dir);
+  while (len > 1 && dir[len - 1] == '/')
+    len--;
+  if (len >= PATH_MAX)
+    return -ENAMETOOLONG;
+  memcpy(path, dir, len);
+  path[len] = '\0';
+
+  struct builder builder = {0};
+  int rc = add_dir(&builder, path, len, path + len + 1);
+  if (rc == 0) {
+    header.num_records = builder.num_records;
+    rc = write_all(fd_manifest, &header, sizeof(header));
+  }
+  if (rc == 0)
+    rc = write_all(fd_manifest, builder.data, builder.len);
+  free(builder.data);
+  return rc;
+}
+
+int manifest_load(struct manifest manifest[static 1], int fd_manifest) {
+  *manifest = (struct manifest){0};
+  struct stat st;
+  if (fstat(fd_manifest, &st) < 0)
+    return -errno;
+  size_t len = st.st_size;
+  if (len < sizeof(struct manifest_header))
+    return -EINVAL;
+
+  uint8_t *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd_manifest, 0);
+  if (map == MAP_FAILED)
+    return -errno;
+  manifest->map = map;
+  manifest->len = len;
+
+  struct manifest_header header;
+  memcpy(&header, map, sizeof(header));
+  size_t pos = sizeof(header);
+  if (memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) != 0 ||
+      header.num_records > (len - pos) / sizeof(struct manifest_record)) {
+    manifest_free(manifest);
+    return -EINVAL;
+  }
+  manifest->built = (struct timespec){.tv_sec = header.built_sec,
+                                      .tv_nsec = header.built_nsec};
+
+  manifest->num_buckets = INITIAL_BUCKETS;
+  while (manifest->num_buckets < 2 * header.num_records)
+    manifest->num_buckets *= 2;
+  manifest->buckets =
+      calloc(manifest->num_buckets, sizeof(*manifest->buckets));
+  manifest->entries = calloc(header.num_records, sizeof(*manifest->entries));
+  if (manifest->buckets == NULL || manifest->entries == NULL) {
+    manifest_free(manifest);
+    return -ENOMEM;
+  }
+
+  for (size_t i = 0; i < header.num_records; i++) {
+    struct manifest_record record;
+    if (len - pos < sizeof(record)) {
+      manifest_free(manifest);
+      return -EINVAL;
+    }
+    memcpy(&record, map + pos, sizeof(record));
+    pos += sizeof(record);
+    if (record.path_len > len - pos) {
+      manifest_free(manifest);
+      return -EINVAL;
+    }
+
+    struct manifest_entry *entry = &manifest->entries[i];
+    *entry = (struct manifest_entry){
+        .path = (const char *)map + pos,
+        .path_len = record.path_len,
+        .delta_size = record.delta_size,
+        .ctime = {.tv_sec = record.ctime_sec, .tv_nsec = record.ctime_nsec},
+        .target_size = record.target_size};
+    size_t bucket = hash_bytes(FNV_OFFSET, entry->path, entry->path_len) &
+                    (manifest->num_buckets - 1);
+    entry->next = manifest->buckets[bucket];
+    manifest->buckets[bucket] = entry;
+
+    // the padding of the last record may be cut off
+    pos += padded_len(record.path_len);
+    if (pos > len)
+      pos = len;
+  }
+  return 0;
+}
+
+void manifest_free(struct manifest manifest[static 1]) {
+  free(manifest->buckets);
+  free(manifest->entries);
+  if (manifest->map)
+    munmap(manifest->map, manifest->len);
+  *manifest = (struct manifest){0};
+}
+
+const struct manifest_entry *
+manifest_find(const struct manifest manifest[static 1], const char *dir,
+              const char *name) {
+  if (manifest->buckets == NULL)
+    return NULL;
+
+  size_t dir_len = strlen(dir), name_len = strlen(name);
+  uint64_t h = hash_bytes(FNV_OFFSET, dir, dir_len);
+  if (dir_len > 0)
+    h = hash_bytes(h, "/", 1);
+  h = hash_bytes(h, name, name_len);
+
+  size_t path_len = dir_len + (dir_len > 0) + name_len;
+  for (const struct manifest_entry *entry =
+           manifest->buckets[h & (manifest->num_buckets - 1)];
+       entry; entry = entry->next) {
+    if (entry->path_len != path_len)
+      continue;
+    if (dir_len > 0 && (memcmp(entry->path, dir, dir_len) != 0 ||
+                        entry->path[dir_len] != '/'))
+      continue;
+    if (memcmp(entry->path + path_len - name_len, name, name_len) == 0)
+      return entry;
+  }
+  return NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define MANIFEST_MAGIC "VCDMAN01"
+
+// on-disk layout of a manifest in host byte order, followed by num_records
+// records
+struct manifest_header {
+  char magic[8];
+  // files whose ctime is later may have changed since the manifest was built
+  int64_t built_sec, built_nsec;
+  uint64_t num_records;
+};
+
+// a patched file, followed by path_len bytes of its path relative to the
+// diff directory, padded to a multiple of 8 bytes
+struct manifest_record {
+  uint64_t delta_size;
+  int64_t ctime_sec, ctime_nsec;
+  uint64_t target_size;
+  uint64_t path_len;
+};
+
+struct manifest_entry {
+  const char *path;
+  size_t path_len;
+  off_t delta_size;
+  // any change to the delta or its xattrs updates its ctime
+  struct timespec ctime;
+  off_t target_size;
+  struct manifest_entry *next;
+};
+
+// the patched files of a diff directory, looked up by path
+struct manifest {
+  struct timespec built;
+  uint8_t *map;
+  size_t len;
+  struct manifest_entry *entries;
+  struct manifest_entry **buckets;
+  size_t num_buckets;
+};
+
+int manifest_build(const char *dir, int fd_manifest);
+
+int manifest_load(struct manifest manifest[static 1], int fd_manifest);
+
+void manifest_free(struct manifest manifest[static 1]);
+
+// finds dir/name, dir is empty for the top of the diff directory
+const struct manifest_entry *
+manifest_find(const struct manifest manifest[static 1], const char *dir,
+              const char *name);
+#endif
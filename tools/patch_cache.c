@@ -0,0 +1,342 @@
+#include "patch_cache.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#define INITIAL_BUCKETS 64
+
+static size_t hash_key(const struct patch_key *key) {
+  uint64_t h = (uint64_t)key->ino * 0x9E3779B97F4A7C15ull;
+  h ^= (uint64_t)key->dev + (h << 6) + (h >> 2);
+  h ^= (uint64_t)key->src_ino * 0xC2B2AE3D27D4EB4Full;
+  h ^= key->chain;
+  return (size_t)(h ^ (h >> 29));
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+int patch_key_equal(const struct patch_key a[static 1],
+                    const struct patch_key b[static 1]) {
+  return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+         same_time(&a->mtime, &b->mtime) && a->src_dev == b->src_dev &&
+         a->src_ino == b->src_ino && a->src_size == b->src_size &&
+         same_time(&a->src_mtime, &b->src_mtime) && a->chain == b->chain;
+}
+
+int patch_key_make(struct patch_key key[static 1], int fd_source,
+                   int fd_delta) {
+  struct stat st_delta, st_source = {0};
+  if (fstat(fd_delta, &st_delta) < 0 ||
+      (fd_source >= 0 && fstat(fd_source, &st_source) < 0))
+    return -errno;
+
+  *key = (struct patch_key){.dev = st_delta.st_dev,
+                            .ino = st_delta.st_ino,
+                            .size = st_delta.st_size,
+                            .mtime = st_delta.st_mtim,
+                            .src_dev = st_source.st_dev,
+                            .src_ino = st_source.st_ino,
+                            .src_size = st_source.st_size,
+                            .src_mtime = st_source.st_mtim};
+  return 0;
+}
+
+// identifies the deltas in the middle of a chain, FNV-1a over their stat
+static int hash_chain(uint64_t *chain, size_t num_deltas,
+                      const int fd_deltas[static num_deltas]) {
+  uint64_t h = 0xCBF29CE484222325ull;
+  for (size_t i = 0; i < num_deltas; i++) {
+    struct stat st;
+    if (fstat(fd_deltas[i], &st) < 0)
+      return -errno;
+    uint64_t fields[] = {st.st_dev, st.st_ino, st.st_size,
+                         st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+    for (size_t j = 0; j < sizeof(fields) / sizeof(*fields); j++)
+      h = (h ^ fields[j]) * 0x100000001B3ull;
+  }
+  *chain = num_deltas > 0 ? h : 0;
+  return 0;
+}
+
+static void lru_unlink(struct patch_cache *cache, struct patch_entry *entry) {
+  if (entry->lru_prev)
+    entry->lru_prev->lru_next = entry->lru_next;
+  else
+    cache->lru_head = entry->lru_next;
+  if (entry->lru_next)
+    entry->lru_next->lru_prev = entry->lru_prev;
+  else
+    cache->lru_tail = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_append(struct patch_cache *cache, struct patch_entry *entry) {
+  entry->lru_prev = cache->lru_tail;
+  entry->lru_next = NULL;
+  if (cache->lru_tail)
+    cache->lru_tail->lru_next = entry;
+  else
+    cache->lru_head = entry;
+  cache->lru_tail = entry;
+}
+
+static int grow_buckets(struct patch_cache *cache) {
+  size_t num_buckets = cache->num_buckets * 2;
+  struct patch_entry **buckets = calloc(num_buckets, sizeof(*buckets));
+  if (buckets == NULL)
+    return -ENOMEM;
+
+  for (size_t i = 0; i < cache->num_buckets; i++) {
+    struct patch_entry *entry = cache->buckets[i];
+    while (entry) {
+      struct patch_entry *next = entry->hash_next;
+      size_t bucket = hash_key(&entry->key) & (num_buckets - 1);
+      entry->hash_next = buckets[bucket];
+      buckets[bucket] = entry;
+      entry = next;
+    }
+  }
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->num_buckets = num_buckets;
+  return 0;
+}
+
+static struct patch_entry *lookup(struct patch_cache *cache,
+                                  const struct patch_key *key) {
+  size_t bucket = hash_key(key) & (cache->num_buckets - 1);
+  for (struct patch_entry *entry = cache->buckets[bucket]; entry;
+       entry = entry->hash_next)
+    if (patch_key_equal(&entry->key, key))
+      return entry;
+  return NULL;
+}
+
+static void insert(struct patch_cache *cache, struct patch_entry *entry) {
+  // growing is best effort, a longer chain is still correct
+  if (cache->num_entries >= cache->num_buckets)
+    grow_buckets(cache);
+
+  size_t bucket = hash_key(&entry->key) & (cache->num_buckets - 1);
+  entry->hash_next = cache->buckets[bucket];
+  cache->buckets[bucket] = entry;
+  cache->num_entries++;
+  cache->memory += entry->memory;
+}
+
+static void evict(struct patch_cache *cache, struct patch_entry *entry) {
+  size_t bucket = hash_key(&entry->key) & (cache->num_buckets - 1);
+  struct patch_entry **link = &cache->buckets[bucket];
+  while (*link != entry)
+    link = &(*link)->hash_next;
+  *link = entry->hash_next;
+
+  cache->num_entries--;
+  cache->memory -= entry->memory;
+  free_data(&entry->target, &entry->source);
+  free(entry);
+}
+
+static void evict_oldest(struct patch_cache *cache) {
+  struct patch_entry *entry = cache->lru_head;
+  lru_unlink(cache, entry);
+  evict(cache, entry);
+}
+
+// drop unreferenced entries until the cache fits into its memory budget
+static void shrink(struct patch_cache *cache) {
+  while (cache->memory > cache->max_memory && cache->lru_head)
+    evict_oldest(cache);
+}
+
+static int expired(struct patch_cache *cache, struct patch_entry *entry,
+                   const struct timespec *now) {
+  return now->tv_sec - entry->released.tv_sec > (time_t)cache->timeout ||
+         (now->tv_sec - entry->released.tv_sec == (time_t)cache->timeout &&
+          now->tv_nsec >= entry->released.tv_nsec);
+}
+
+static void *reaper(void *arg) {
+  struct patch_cache *cache = arg;
+
+  pthread_mutex_lock(&cache->lock);
+  while (cache->running) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (cache->lru_head && expired(cache, cache->lru_head, &now))
+      evict_oldest(cache);
+
+    // sleep until the oldest entry expires or something is released
+    struct timespec deadline = now;
+    deadline.tv_sec += cache->timeout ? cache->timeout : 1;
+    if (cache->lru_head) {
+      deadline = cache->lru_head->released;
+      deadline.tv_sec += cache->timeout;
+    }
+    pthread_cond_timedwait(&cache->wakeup, &cache->lock, &deadline);
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return NULL;
+}
+
+int patch_cache_init(struct patch_cache cache[static 1], unsigned int timeout,
+                     size_t max_memory, int lazy, int background) {
+  *cache = (struct patch_cache){.timeout = timeout,
+                                .max_memory = max_memory,
+                                .lazy = lazy,
+                                .background = background,
+                                .num_buckets = INITIAL_BUCKETS};
+  cache->buckets = calloc(INITIAL_BUCKETS, sizeof(*cache->buckets));
+  if (cache->buckets == NULL)
+    return -ENOMEM;
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&cache->wakeup, &attr);
+  pthread_condattr_destroy(&attr);
+  pthread_mutex_init(&cache->lock, NULL);
+  return 0;
+}
+
+int patch_cache_start(struct patch_cache cache[static 1]) {
+  cache->running = 1;
+  int rc = pthread_create(&cache->reaper, NULL, reaper, cache);
+  if (rc != 0) {
+    cache->running = 0;
+    return -rc;
+  }
+  return 0;
+}
+
+void patch_cache_destroy(struct patch_cache cache[static 1]) {
+  pthread_mutex_lock(&cache->lock);
+  int running = cache->running;
+  cache->running = 0;
+  pthread_cond_signal(&cache->wakeup);
+  pthread_mutex_unlock(&cache->lock);
+  if (running)
+    pthread_join(cache->reaper, NULL);
+
+  for (size_t i = 0; i < cache->num_buckets; i++) {
+    struct patch_entry *entry = cache->buckets[i];
+    while (entry) {
+      struct patch_entry *next = entry->hash_next;
+      free_data(&entry->target, &entry->source);
+      free(entry);
+      entry = next;
+    }
+  }
+  free(cache->buckets);
+  pthread_cond_destroy(&cache->wakeup);
+  pthread_mutex_destroy(&cache->lock);
+}
+
+static int load_patch(struct patch_cache *cache, struct patch_entry *loaded,
+                      int fd_source, size_t num_deltas,
+                      const int fd_deltas[static num_deltas], int fd_index) {
+  // flattening a chain needs every delta in it decoded completely
+  if (num_deltas > 1)
+    return load_diff_chain(&loaded->target, &loaded->source, fd_source,
+                           num_deltas, fd_deltas);
+
+  int fd_delta = fd_deltas[0];
+  // a missing or stale index falls back to decoding the delta
+  int rc = -ENOENT;
+  if (fd_index >= 0)
+    rc = load_index(&loaded->target, &loaded->source, fd_source, fd_delta,
+                    fd_index);
+  if (rc < 0 && cache->lazy)
+    rc = load_diff_lazy(&loaded->target, &loaded->source, fd_source,
+                        fd_delta);
+  // the entry is heap allocated, so the decoder may keep pointing into it
+  if (rc < 0 && cache->background)
+    rc = load_diff_background(&loaded->target, &loaded->source, fd_source,
+                              fd_delta);
+  if (rc < 0)
+    rc = load_diff(&loaded->target, &loaded->source, fd_source, fd_delta);
+  return rc;
+}
+
+int patch_cache_acquire(struct patch_cache cache[static 1], int fd_source,
+                        size_t num_deltas,
+                        const int fd_deltas[static num_deltas], int fd_index,
+                        struct patch_entry **entry) {
+  struct patch_key key;
+  int rc = patch_key_make(&key, fd_source, fd_deltas[num_deltas - 1]);
+  if (rc < 0)
+    return rc;
+  rc = hash_chain(&key.chain, num_deltas - 1, fd_deltas);
+  if (rc < 0)
+    return rc;
+
+  pthread_mutex_lock(&cache->lock);
+  struct patch_entry *found = lookup(cache, &key);
+  if (found) {
+    if (found->refcount++ == 0)
+      lru_unlink(cache, found);
+    pthread_mutex_unlock(&cache->lock);
+    *entry = found;
+    return 0;
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  // decode without holding the lock, concurrent misses race to insert
+  struct patch_entry *loaded = calloc(1, sizeof(struct patch_entry));
+  if (loaded == NULL)
+    return -ENOMEM;
+  loaded->key = key;
+  rc = load_patch(cache, loaded, fd_source, num_deltas, fd_deltas, fd_index);
+  if (rc < 0) {
+    free_data(&loaded->target, &loaded->source);
+    free(loaded);
+    return rc;
+  }
+  loaded->memory = memory_usage(&loaded->target);
+  loaded->refcount = 1;
+
+  pthread_mutex_lock(&cache->lock);
+  found = lookup(cache, &key);
+  if (found) {
+    if (found->refcount++ == 0)
+      lru_unlink(cache, found);
+  } else {
+    insert(cache, loaded);
+    shrink(cache);
+  }
+  pthread_mutex_unlock(&cache->lock);
+
+  if (found) {
+    free_data(&loaded->target, &loaded->source);
+    free(loaded);
+    loaded = found;
+  }
+  *entry = loaded;
+  return 0;
+}
+
+void patch_cache_release(struct patch_cache cache[static 1],
+                         struct patch_entry entry[static 1]) {
+  pthread_mutex_lock(&cache->lock);
+  if (--entry->refcount == 0) {
+    // lazily decoded patches grow while they are read
+    size_t memory = memory_usage(&entry->target);
+    cache->memory += memory - entry->memory;
+    entry->memory = memory;
+    if (cache->timeout == 0 || entry->memory > cache->max_memory) {
+      evict(cache, entry);
+    } else {
+      clock_gettime(CLOCK_MONOTONIC, &entry->released);
+      lru_append(cache, entry);
+      shrink(cache);
+      pthread_cond_signal(&cache->wakeup);
+    }
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
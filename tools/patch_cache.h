@@ -0,0 +1,73 @@
+#ifndef PATCH_CACHE_H
+#define PATCH_CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "vcdiff_incremental.h"
+
+// identifies a decoded patch, a change to either file invalidates it
+struct patch_key {
+  dev_t dev, src_dev;
+  ino_t ino, src_ino;
+  off_t size, src_size;
+  struct timespec mtime, src_mtime;
+  // the deltas between the two in a chain, 0 if there are none
+  uint64_t chain;
+};
+
+struct patch_entry {
+  struct patch_key key;
+  struct target_stream target;
+  struct source_stream source;
+  size_t refcount;
+  size_t memory;
+  struct timespec released;
+  struct patch_entry *hash_next;
+  struct patch_entry *lru_prev, *lru_next;
+};
+
+struct patch_cache {
+  pthread_mutex_t lock;
+  pthread_cond_t wakeup;
+  pthread_t reaper;
+  int running;
+  unsigned int timeout;
+  size_t max_memory;
+  int lazy;
+  int background;
+  size_t memory;
+  struct patch_entry **buckets;
+  size_t num_buckets;
+  size_t num_entries;
+  // unreferenced entries, least recently released first
+  struct patch_entry *lru_head, *lru_tail;
+};
+
+// identifies the files behind fd_delta and fd_source, which may be -1 for an
+// unpatched file
+int patch_key_make(struct patch_key key[static 1], int fd_source,
+                   int fd_delta);
+
+int patch_key_equal(const struct patch_key a[static 1],
+                    const struct patch_key b[static 1]);
+
+int patch_cache_init(struct patch_cache cache[static 1], unsigned int timeout,
+                     size_t max_memory, int lazy, int background);
+
+int patch_cache_start(struct patch_cache cache[static 1]);
+
+void patch_cache_destroy(struct patch_cache cache[static 1]);
+
+// fd_deltas is a chain of deltas applied to fd_source in order, the patched
+// file is that of the last one, fd_index only applies to single deltas
+int patch_cache_acquire(struct patch_cache cache[static 1], int fd_source,
+                        size_t num_deltas,
+                        const int fd_deltas[static num_deltas], int fd_index,
+                        struct patch_entry **entry);
+
+void patch_cache_release(struct patch_cache cache[static 1],
+                         struct patch_entry entry[static 1]);
+#endif
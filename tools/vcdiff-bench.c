@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vcdiff_incremental.h"
+
+enum mode { MODE_MMAP, MODE_URING, MODE_DIRECT };
+
+static const char *mode_names[] = {"mmap", "io_uring", "io_uring+O_DIRECT"};
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// drops the base file from the page cache, the mapping is shared with the
+// target so its pages have to be unmapped first
+static void evict(struct source_stream *source, int fd_source) {
+  madvise(source->data, source->len, MADV_DONTNEED);
+  posix_fadvise(fd_source, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+static int run(struct target_stream *target, struct source_stream *source,
+               int fd_source, enum mode mode, int random, size_t chunk,
+               unsigned depth) {
+  struct source_reader *reader = NULL;
+  int fd = fd_source;
+  if (mode != MODE_MMAP) {
+    int rc = source_reader_new(&reader, depth, mode == MODE_DIRECT);
+    if (rc < 0) {
+      printf("%-18s %-6s unsupported: %s\n", mode_names[mode],
+             random ? "random" : "seq", strerror(-rc));
+      return 0;
+    }
+  }
+  if (mode == MODE_DIRECT) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/self/fd/%i", fd_source);
+    fd = open(path, O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+      perror("Error opening dict with O_DIRECT");
+      source_reader_free(reader);
+      return 0;
+    }
+  }
+
+  uint8_t *buf = malloc(chunk);
+  if (buf == NULL) {
+    if (fd != fd_source)
+      close(fd);
+    source_reader_free(reader);
+    return -1;
+  }
+  size_t num_chunks = (target->offset + chunk - 1) / chunk;
+  evict(source, fd_source);
+
+  struct read_cursor cursor = {0};
+  unsigned seed = 1;
+  size_t total = 0;
+  double start = now();
+  for (size_t i = 0; i < num_chunks; i++) {
+    size_t k = i;
+    if (random) {
+      seed = seed * 1103515245 + 12345;
+      k = ((size_t)seed << 16 ^ seed >> 8) % num_chunks;
+    }
+    int rc = mode == MODE_MMAP
+                 ? read_range_cursor(target, &cursor, k * chunk, chunk, buf)
+                 : read_range_reader(target, &cursor, reader, fd, k * chunk,
+                                     chunk, buf);
+    if (rc < 0) {
+      fprintf(stderr, "Error reading: %s\n", strerror(-rc));
+      break;
+    }
+    total += rc;
+  }
+  double elapsed = now() - start;
+  printf("%-18s %-6s %8.3fs %8.1f MiB/s\n", mode_names[mode],
+         random ? "random" : "seq", elapsed, total / elapsed / (1 << 20));
+
+  free(buf);
+  if (fd != fd_source)
+    close(fd);
+  source_reader_free(reader);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3 || argc > 5) {
+    fprintf(stderr, "Usage: %s [dict] [delta] [chunk] [depth]\n", argv[0]);
+    return 1;
+  }
+  size_t chunk = argc > 3 ? strtoul(argv[3], NULL, 10) : 128 * 1024;
+  unsigned depth = argc > 4 ? strtoul(argv[4], NULL, 10) : 64;
+  if (chunk == 0 || depth == 0) {
+    fprintf(stderr, "chunk and depth must be positive\n");
+    return 1;
+  }
+
+  int source_fd = open(argv[1], O_RDONLY);
+  if (source_fd < 0) {
+    perror("Error opening dict");
+    return 1;
+  }
+  int delta_fd = open(argv[2], O_RDONLY);
+  if (delta_fd < 0) {
+    perror("Error opening delta");
+    return 1;
+  }
+
+  struct target_stream target;
+  struct source_stream source;
+  int rc = load_diff(&target, &source, source_fd, delta_fd);
+  if (rc < 0) {
+    fprintf(stderr, "Error loading diff: %s\n", strerror(-rc));
+    return 1;
+  }
+  close(delta_fd);
+
+  // every run starts with the dict evicted from the page cache
+  for (int random = 0; random <= 1 && rc == 0; random++)
+    for (enum mode mode = MODE_MMAP; mode <= MODE_DIRECT && rc == 0; mode++)
+      rc = run(&target, &source, source_fd, mode, random, chunk, depth);
+
+  free_data(&target, &source);
+  return rc < 0 ? 1 : 0;
+}
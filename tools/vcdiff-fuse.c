@@ -13,7 +13,7 @@
 
 #define _GNU_SOURCE
 
-#define FUSE_USE_VERSION 26
+#define FUSE_USE_VERSION 312
 
 #include <dirent.h>
 #include <errno.h>
@@ -21,18 +21,21 @@
 #include <limits.h>
 #include <pthread.h>
 #include <search.h>
-#include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/fsuid.h>
-#include <sys/time.h>
-#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/xattr.h>
 #include <unistd.h>
 
-#include <fuse.h>
+#include <fuse_lowlevel.h>
 
+#include "manifest.h"
+#include "patch_cache.h"
 #include "vcdiff_incremental.h"
 
 static const char *patchFsVersion = "2023.08.01";
@@ -47,299 +50,1054 @@ static const char *patchFsVersion = "2023.08.01";
 #endif
 
 static char *src = NULL;
-static int src_len;
-static char *base = NULL;
-static int base_len;
-
-#define SRC(p)                                                                 \
-  char __##p[PATH_MAX + 1];                                                    \
-  strncpy(__##p, src, PATH_MAX);                                               \
-  strncat(__##p, p, PATH_MAX - src_len);                                       \
-  p = __##p;
-
-#define TRY(x, s, f, r)                                                        \
-  int(r) = (x);                                                                \
-  if ((r) >= 0) {                                                              \
-    s;                                                                         \
-  } else {                                                                     \
-    int __e = -errno;                                                          \
-    f;                                                                         \
-    return __e;                                                                \
-  }
-#define RET(x, s, f)                                                           \
-  TRY(x, s, f, __r);                                                           \
-  return 0;
+static size_t src_len;
+
+struct patchfs_config {
+  char *base;
+  char *index;
+  char *manifest;
+  unsigned int cache_timeout;
+  unsigned long cache_size;
+  int lazy;
+  int background;
+  int base_populate;
+  int base_hugepages;
+  int uring;
+  int uring_direct;
+  double entry_timeout;
+  double attr_timeout;
+};
+
+static struct patchfs_config config = {.cache_timeout = 30,
+                                       .cache_size = 256,
+                                       .entry_timeout = 1.0,
+                                       .attr_timeout = 1.0};
+
+static struct patch_cache cache;
+static struct fuse_session *session;
 
-#define IDRET(x, s, f)                                                         \
-  struct fuse_context *ctx = fuse_get_context();                               \
-  int ouid __attribute__((unused)) = setfsuid(ctx->uid);                       \
-  int ogid __attribute__((unused)) = setfsgid(ctx->gid);                       \
-  RET(x, s; setfsuid(ouid); setfsgid(ogid), f; setfsuid(ouid); setfsgid(ogid))
+#ifdef FUSE_CAP_PASSTHROUGH
+// set if the kernel supports passthrough, cleared once registering a backing
+// file is refused, e.g. without CAP_SYS_ADMIN
+static atomic_int passthrough;
+#endif
+
+// directories paths are resolved against, opened once at mount
+static int base_fd = -1;
+static int index_fd = -1;
+
+// a file in readwritepath, the kernel refers to it by the address of this
+// struct, the root by FUSE_ROOT_ID
+struct inode {
+  // O_PATH descriptor everything else is opened relative to
+  int fd;
+  mode_t type;
+  dev_t dev;
+  ino_t ino;
+  // lookups not yet forgotten by the kernel
+  uint64_t nlookup;
+  // path below readwritepath for directories if there is a manifest
+  char *path;
+  pthread_mutex_t lock;
+  // files behind the last open
+  struct patch_key version;
+  // patched size, -1 if unpatched, valid while the file keeps size_ctime
+  off_t size;
+  struct timespec size_ctime;
+  // open handles served through the filesystem and in passthrough mode, the
+  // kernel refuses to mix both while the file is open
+  unsigned opens, passthrough_opens;
+  // shared by all passthrough opens, the kernel allows one backing file per
+  // inode, registered for the file at backing_dev and backing_ino
+  int backing_id;
+  dev_t backing_dev;
+  ino_t backing_ino;
+};
+
+static struct inode root;
+// tsearch tree of all inodes, keyed by dev and ino
+static void *inodes;
+static pthread_mutex_t inodes_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct manifest manifest;
+
+// io_uring readers of the loop threads, created on their first read
+static pthread_key_t reader_key;
+
+#define READER_DEPTH 64
 
 struct patch_handle {
   int fd_source, fd_raw;
-  struct target_stream target;
-  struct source_stream source;
+  // fd_source opened with O_DIRECT for uring_direct, -1 otherwise
+  int fd_direct;
+  // reads of unpatched files go to the backing file of the inode if set
+  int passthrough;
+  struct patch_entry *patch;
+  struct read_cursor cursor;
 };
 
-static int correct_stat_size(const char *path, struct stat *stbuf) {
+struct dir_handle {
+  DIR *dp;
+  off_t offset;
+  struct dirent *entry;
+};
+
+static struct inode *get_inode(fuse_ino_t ino) {
+  if (ino == FUSE_ROOT_ID)
+    return &root;
+  return (struct inode *)(uintptr_t)ino;
+}
+
+static int compare_inodes(const void *a, const void *b) {
+  const struct inode *x = a, *y = b;
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  if (x->ino != y->ino)
+    return x->ino < y->ino ? -1 : 1;
+  return 0;
+}
+
+static int same_time(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec == b->tv_sec && a->tv_nsec == b->tv_nsec;
+}
+
+static int time_before(const struct timespec *a, const struct timespec *b) {
+  return a->tv_sec < b->tv_sec ||
+         (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// fills in what the manifest knows about a new inode, files missing from it
+// are unpatched unless they changed after it was built
+static void init_from_manifest(struct inode *inode, struct inode *parent,
+                               const char *name, const struct stat *st) {
+  if (parent->path == NULL)
+    return;
+
+  if (S_ISDIR(st->st_mode)) {
+    if (parent->path[0] == '\0')
+      inode->path = strdup(name);
+    else if (asprintf(&inode->path, "%s/%s", parent->path, name) < 0)
+      inode->path = NULL;
+    return;
+  }
+  if (!S_ISREG(st->st_mode))
+    return;
+
+  const struct manifest_entry *entry =
+      manifest_find(&manifest, parent->path, name);
+  if (entry == NULL) {
+    if (time_before(&st->st_ctim, &manifest.built)) {
+      inode->size = -1;
+      inode->size_ctime = st->st_ctim;
+    }
+  } else if (same_time(&entry->ctime, &st->st_ctim) &&
+             entry->delta_size == st->st_size) {
+    inode->size = entry->target_size;
+    inode->size_ctime = st->st_ctim;
+  }
+}
+
+// takes over fd, or closes it if the file already has an inode
+static struct inode *ref_inode(int fd, const struct stat *st,
+                               struct inode *parent, const char *name) {
+  struct inode key = {.dev = st->st_dev, .ino = st->st_ino};
+
+  pthread_mutex_lock(&inodes_lock);
+  void **found = tfind(&key, &inodes, compare_inodes);
+  if (found != NULL) {
+    struct inode *inode = *found;
+    inode->nlookup++;
+    pthread_mutex_unlock(&inodes_lock);
+    close(fd);
+    return inode;
+  }
+
+  struct inode *inode = malloc(sizeof(struct inode));
+  if (inode == NULL) {
+    pthread_mutex_unlock(&inodes_lock);
+    return NULL;
+  }
+  *inode = (struct inode){.fd = fd,
+                          .type = st->st_mode & S_IFMT,
+                          .dev = st->st_dev,
+                          .ino = st->st_ino,
+                          .nlookup = 1,
+                          .size_ctime = {.tv_nsec = -1}};
+  pthread_mutex_init(&inode->lock, NULL);
+  init_from_manifest(inode, parent, name, st);
+  if (tsearch(inode, &inodes, compare_inodes) == NULL) {
+    pthread_mutex_unlock(&inodes_lock);
+    free(inode->path);
+    free(inode);
+    return NULL;
+  }
+  pthread_mutex_unlock(&inodes_lock);
+  return inode;
+}
+
+static void unref_inode(struct inode *inode, uint64_t nlookup) {
+  if (inode == &root)
+    return;
+
+  pthread_mutex_lock(&inodes_lock);
+  inode->nlookup -= nlookup;
+  if (inode->nlookup > 0) {
+    pthread_mutex_unlock(&inodes_lock);
+    return;
+  }
+  tdelete(inode, &inodes, compare_inodes);
+  pthread_mutex_unlock(&inodes_lock);
+  close(inode->fd);
+  pthread_mutex_destroy(&inode->lock);
+  free(inode->path);
+  free(inode);
+}
+
+// O_PATH descriptors can only be reopened or have xattrs read through proc
+static void proc_path(char path[static 32], int fd) {
+  snprintf(path, 32, "/proc/self/fd/%i", fd);
+}
+
+// sets size to -1 if the file is not patched
+static int read_patched_size(int fd, off_t *size) {
+  char path[32];
+  proc_path(path, fd);
   char src_size[32];
-  int length = getxattr(path, "user.diff_src_size", src_size, 31);
+  ssize_t length = getxattr(path, "user.diff_src_size", src_size, 31);
   if (length < 0) {
-    if (errno == ENODATA)
-      return 0;
+    if (errno != ENODATA)
+      return -errno;
+    *size = -1;
+    return 0;
+  }
+  src_size[length] = '\0';
+  *size = strtoul(src_size, NULL, 10);
+  return 0;
+}
+
+// the xattr is only read again once the ctime of the file changed, which
+// any write to its data or xattrs does
+static int correct_stat_size(struct inode *inode, struct stat *stbuf) {
+  if (!S_ISREG(stbuf->st_mode))
+    return 0;
+
+  pthread_mutex_lock(&inode->lock);
+  int known = same_time(&inode->size_ctime, &stbuf->st_ctim);
+  off_t size = inode->size;
+  pthread_mutex_unlock(&inode->lock);
+
+  if (!known) {
+    int rc = read_patched_size(inode->fd, &size);
+    if (rc < 0)
+      return rc;
+    pthread_mutex_lock(&inode->lock);
+    inode->size = size;
+    inode->size_ctime = stbuf->st_ctim;
+    pthread_mutex_unlock(&inode->lock);
+  }
+  if (size >= 0)
+    stbuf->st_size = size;
+  return 0;
+}
+
+static int stat_inode(struct inode *inode, struct stat *stbuf) {
+  if (fstatat(inode->fd, "", stbuf, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0)
+    return -errno;
+  return correct_stat_size(inode, stbuf);
+}
+
+static int lookup_entry(fuse_ino_t parent, const char *name,
+                        struct fuse_entry_param *e) {
+  *e = (struct fuse_entry_param){.attr_timeout = config.attr_timeout,
+                                 .entry_timeout = config.entry_timeout};
+
+  struct inode *dir = get_inode(parent);
+  int fd = openat(dir->fd, name, O_PATH | O_NOFOLLOW);
+  if (fd < 0)
     return -errno;
+  if (fstatat(fd, "", &e->attr, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) < 0) {
+    int rc = -errno;
+    close(fd);
+    return rc;
+  }
+
+  struct inode *inode = ref_inode(fd, &e->attr, dir, name);
+  if (inode == NULL) {
+    close(fd);
+    return -ENOMEM;
   }
-  stbuf->st_size = strtoul(src_size, NULL, 10);
+  int rc = correct_stat_size(inode, &e->attr);
+  if (rc < 0) {
+    unref_inode(inode, 1);
+    return rc;
+  }
+  e->ino = (uintptr_t)inode;
   return 0;
 }
 
-static int patchfs_getattr(const char *path, struct stat *stbuf) {
-  SRC(path)
-  RET(lstat(path, stbuf), TRY(correct_stat_size(path, stbuf), , , r2), )
+static void patchfs_lookup(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  struct fuse_entry_param e;
+  int rc = lookup_entry(parent, name, &e);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_entry(req, &e);
 }
 
-static int patchfs_access(const char *path, int mask) {
-  SRC(path)
-  RET(access(path, mask), , )
+static void patchfs_forget(fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+  unref_inode(get_inode(ino), nlookup);
+  fuse_reply_none(req);
 }
 
-static int patchfs_readlink(const char *path, char *buf, size_t size) {
-  SRC(path)
-  RET(readlink(path, buf, size - 1), buf[__r] = '\0', )
+static void patchfs_forget_multi(fuse_req_t req, size_t count,
+                                 struct fuse_forget_data *forgets) {
+  for (size_t i = 0; i < count; i++)
+    unref_inode(get_inode(forgets[i].ino), forgets[i].nlookup);
+  fuse_reply_none(req);
 }
 
-static int patchfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                           off_t offset, struct fuse_file_info *fi) {
-  (void)offset;
+static void patchfs_getattr(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
   (void)fi;
+  struct stat stbuf;
+  int rc = stat_inode(get_inode(ino), &stbuf);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_attr(req, &stbuf, config.attr_timeout);
+}
 
-  DIR *dp;
-  struct dirent *de;
+static void patchfs_readlink(fuse_req_t req, fuse_ino_t ino) {
+  char buf[PATH_MAX + 1];
+  ssize_t length = readlinkat(get_inode(ino)->fd, "", buf, sizeof(buf));
+  if (length < 0) {
+    fuse_reply_err(req, errno);
+    return;
+  }
+  if ((size_t)length == sizeof(buf)) {
+    fuse_reply_err(req, ENAMETOOLONG);
+    return;
+  }
+  buf[length] = '\0';
+  fuse_reply_readlink(req, buf);
+}
 
-  SRC(path)
+static void patchfs_opendir(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  struct dir_handle *handle = calloc(1, sizeof(struct dir_handle));
+  if (handle == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int fd = openat(get_inode(ino)->fd, ".", O_RDONLY | O_DIRECTORY);
+  if (fd < 0) {
+    fuse_reply_err(req, errno);
+    free(handle);
+    return;
+  }
+  handle->dp = fdopendir(fd);
+  if (handle->dp == NULL) {
+    fuse_reply_err(req, errno);
+    close(fd);
+    free(handle);
+    return;
+  }
 
-  dp = opendir(path);
-  if (dp == NULL)
-    return -errno;
+  fi->fh = (uint64_t)handle;
+  if (fuse_reply_open(req, fi) < 0) {
+    closedir(handle->dp);
+    free(handle);
+  }
+}
 
-  while ((de = readdir(dp)) != NULL) {
-    struct stat st;
-    memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
-    if (filler(buf, de->d_name, &st, 0))
-      break;
+static int is_dot_or_dotdot(const char *name) {
+  return name[0] == '.' &&
+         (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+// with plus each entry is looked up and comes with its attributes, saving
+// the kernel a lookup per entry
+static void read_dir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                     off_t offset, struct fuse_file_info *fi, int plus) {
+  struct dir_handle *handle = (struct dir_handle *)fi->fh;
+
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
   }
 
-  closedir(dp);
-  return 0;
+  // an entry that did not fit last time is kept for the next call
+  if (offset != handle->offset) {
+    seekdir(handle->dp, offset);
+    handle->entry = NULL;
+    handle->offset = offset;
+  }
+
+  size_t pos = 0;
+  while (1) {
+    if (handle->entry == NULL) {
+      errno = 0;
+      handle->entry = readdir(handle->dp);
+      if (handle->entry == NULL) {
+        if (errno != 0 && pos == 0) {
+          fuse_reply_err(req, errno);
+          free(buf);
+          return;
+        }
+        break;
+      }
+    }
+
+    struct dirent *de = handle->entry;
+    struct stat st = {.st_ino = de->d_ino, .st_mode = de->d_type << 12};
+    size_t length;
+    if (plus) {
+      struct fuse_entry_param e = {.attr = st};
+      if (!is_dot_or_dotdot(de->d_name)) {
+        int rc = lookup_entry(ino, de->d_name, &e);
+        if (rc == -ENOENT) {
+          // removed since it was read
+          handle->entry = NULL;
+          handle->offset = de->d_off;
+          continue;
+        }
+        if (rc < 0) {
+          if (pos > 0)
+            break;
+          fuse_reply_err(req, -rc);
+          free(buf);
+          return;
+        }
+      }
+      length = fuse_add_direntry_plus(req, buf + pos, size - pos, de->d_name,
+                                      &e, de->d_off);
+      if (length > size - pos) {
+        // the kernel never saw this lookup
+        if (e.ino != 0)
+          unref_inode(get_inode(e.ino), 1);
+        break;
+      }
+    } else {
+      length = fuse_add_direntry(req, buf + pos, size - pos, de->d_name, &st,
+                                 de->d_off);
+      if (length > size - pos)
+        break;
+    }
+    pos += length;
+    handle->entry = NULL;
+    handle->offset = de->d_off;
+  }
+
+  fuse_reply_buf(req, buf, pos);
+  free(buf);
 }
 
-static int patchfs_mknod(const char *path, mode_t mode, dev_t rdev) {
-  (void)path;
+static void patchfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                            off_t offset, struct fuse_file_info *fi) {
+  read_dir(req, ino, size, offset, fi, 0);
+}
+
+static void patchfs_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size,
+                                off_t offset, struct fuse_file_info *fi) {
+  read_dir(req, ino, size, offset, fi, 1);
+}
+
+static void patchfs_releasedir(fuse_req_t req, fuse_ino_t ino,
+                               struct fuse_file_info *fi) {
+  (void)ino;
+  struct dir_handle *handle = (struct dir_handle *)fi->fh;
+  closedir(handle->dp);
+  free(handle);
+  fuse_reply_err(req, 0);
+}
+
+static void patchfs_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode, dev_t rdev) {
+  (void)parent;
+  (void)name;
   (void)mode;
   (void)rdev;
-  return -EROFS;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_mkdir(const char *path, mode_t mode) {
-  (void)path;
+static void patchfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
+                          mode_t mode) {
+  (void)parent;
+  (void)name;
   (void)mode;
-  return -EROFS;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_unlink(const char *path) {
-  (void)path;
-  return -EROFS;
+static void patchfs_unlink(fuse_req_t req, fuse_ino_t parent,
+                           const char *name) {
+  (void)parent;
+  (void)name;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_rmdir(const char *path) {
-  (void)path;
-  return -EROFS;
+static void patchfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+  (void)parent;
+  (void)name;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_symlink(const char *from, const char *to) {
-  (void)from;
-  (void)to;
-  return -EROFS;
+static void patchfs_symlink(fuse_req_t req, const char *link, fuse_ino_t parent,
+                            const char *name) {
+  (void)link;
+  (void)parent;
+  (void)name;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_rename(const char *from, const char *to) {
-  (void)from;
-  (void)to;
-  return -EROFS;
+static void patchfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           fuse_ino_t newparent, const char *newname,
+                           unsigned int flags) {
+  (void)parent;
+  (void)name;
+  (void)newparent;
+  (void)newname;
+  (void)flags;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_link(const char *from, const char *to) {
-  (void)from;
-  (void)to;
-  return -EROFS;
+static void patchfs_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+                         const char *newname) {
+  (void)ino;
+  (void)newparent;
+  (void)newname;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_chmod(const char *path, mode_t mode) {
-  (void)path;
-  (void)mode;
-  return -EROFS;
+static void patchfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+                            int to_set, struct fuse_file_info *fi) {
+  (void)ino;
+  (void)attr;
+  (void)to_set;
+  (void)fi;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_chown(const char *path, uid_t uid, gid_t gid) {
-  (void)path;
-  (void)uid;
-  (void)gid;
-  return -EROFS;
+static void patchfs_create(fuse_req_t req, fuse_ino_t parent, const char *name,
+                           mode_t mode, struct fuse_file_info *fi) {
+  (void)parent;
+  (void)name;
+  (void)mode;
+  (void)fi;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_truncate(const char *path, off_t size) {
-  (void)path;
-  (void)size;
-  return -EROFS;
-}
+// the index mirrors the diff directory, returns -1 if there is none
+static int open_index(int fd_delta) {
+  if (index_fd < 0)
+    return -1;
 
-static int patchfs_utimens(const char *path, const struct timespec ts[2]) {
-  (void)path;
-  (void)ts;
-  return -EROFS;
-}
+  char proc[32], path[PATH_MAX];
+  proc_path(proc, fd_delta);
+  ssize_t length = readlink(proc, path, sizeof(path) - 1);
+  if (length < 0 || (size_t)length <= src_len ||
+      strncmp(path, src, src_len) != 0)
+    return -1;
+  path[length] = '\0';
 
-static int patchfs_open(const char *path, struct fuse_file_info *fi) {
-  SRC(path)
-  struct patch_handle *handle = malloc(sizeof(struct patch_handle));
-  int fd_delta = open(path, O_RDONLY);
-  if (fd_delta < 0) {
-    free(handle);
-    return -errno;
-  }
+  const char *rel_path = path + src_len;
+  while (*rel_path == '/')
+    rel_path++;
+  return openat(index_fd, rel_path, O_RDONLY);
+}
 
+// opens the file user.diff_src of fd names, sets *fd_source to -1 if fd is
+// not a delta
+static int open_diff_src(int fd, int *fd_source) {
   char base_path[PATH_MAX + 1];
-  strncpy(base_path, base, PATH_MAX);
-  int length = fgetxattr(fd_delta, "user.diff_src", base_path + base_len,
-                         PATH_MAX - base_len);
+  ssize_t length =
+      fgetxattr(fd, "user.diff_src", base_path, sizeof(base_path) - 1);
   if (length < 0) {
-    if (errno == ENODATA) {
-      handle->fd_source = -1;
-      handle->fd_raw = fd_delta;
-      fi->fh = (uint64_t)handle;
+    *fd_source = -1;
+    return errno == ENODATA ? 0 : -errno;
+  }
+  base_path[length] = '\0';
+
+  // user.diff_src is relative to the base directory
+  const char *rel_path = base_path;
+  while (*rel_path == '/')
+    rel_path++;
+  *fd_source = openat(base_fd, rel_path, O_RDONLY);
+  return *fd_source < 0 ? -errno : 0;
+}
+
+static int same_file(int a, int b) {
+  struct stat st_a, st_b;
+  return fstat(a, &st_a) == 0 && fstat(b, &st_b) == 0 &&
+         st_a.st_dev == st_b.st_dev && st_a.st_ino == st_b.st_ino;
+}
+
+// a source that carries user.diff_src itself is a delta against yet another
+// file, chain[0] holds the delta being opened, the deltas below it are added
+// until *fd_source is a plain file
+static int follow_chain(int chain[static MAX_DIFF_CHAIN], size_t *depth,
+                        int *fd_source) {
+  for (;;) {
+    int fd_below;
+    int rc = open_diff_src(*fd_source, &fd_below);
+    if (rc < 0)
+      return rc;
+    if (fd_below < 0)
       return 0;
+
+    rc = *depth == MAX_DIFF_CHAIN ? -ELOOP : 0;
+    for (size_t i = 0; i < *depth && rc == 0; i++)
+      if (same_file(chain[i], *fd_source))
+        rc = -ELOOP;
+    if (rc < 0) {
+      close(fd_below);
+      return rc;
     }
-    return -errno;
+    chain[(*depth)++] = *fd_source;
+    *fd_source = fd_below;
   }
-  base_path[base_len + length] = '\0';
+}
 
-  handle->fd_source = open(base_path, O_RDONLY);
-  if (handle->fd_source < 0) {
-    close(fd_delta);
-    free(handle);
+static int open_handle(struct inode *inode, struct patch_handle *handle) {
+  char proc[32];
+  proc_path(proc, inode->fd);
+  int fd_delta = open(proc, O_RDONLY);
+  if (fd_delta < 0)
     return -errno;
+
+  int rc = open_diff_src(fd_delta, &handle->fd_source);
+  if (rc < 0) {
+    close(fd_delta);
+    return rc;
+  }
+  if (handle->fd_source < 0) {
+    handle->fd_raw = fd_delta;
+    return 0;
   }
 
-  int rc =
-      load_diff(&handle->target, &handle->source, handle->fd_source, fd_delta);
+  int chain[MAX_DIFF_CHAIN] = {fd_delta};
+  size_t depth = 1;
+  rc = follow_chain(chain, &depth, &handle->fd_source);
+  if (rc >= 0) {
+    // the cache wants the deltas in the order they are applied
+    int fd_deltas[MAX_DIFF_CHAIN];
+    for (size_t i = 0; i < depth; i++)
+      fd_deltas[i] = chain[depth - 1 - i];
+    int fd_index = depth == 1 ? open_index(fd_delta) : -1;
+    rc = patch_cache_acquire(&cache, handle->fd_source, depth, fd_deltas,
+                             fd_index, &handle->patch);
+    if (fd_index >= 0)
+      close(fd_index);
+  }
+  // the decoded patch does not need the deltas anymore
+  for (size_t i = 1; i < depth; i++)
+    close(chain[i]);
   if (rc < 0) {
     close(fd_delta);
     close(handle->fd_source);
-    free(handle);
+    return rc;
+  }
+  if (close(fd_delta) < 0) {
+    rc = -errno;
+    patch_cache_release(&cache, handle->patch);
+    close(handle->fd_source);
     return rc;
   }
 
-  rc = close(fd_delta);
-  if (rc < 0) {
-    free_data(&handle->target, &handle->source);
+  handle->fd_raw = -1;
+  handle->fd_direct = -1;
+  if (config.uring_direct) {
+    proc_path(proc, handle->fd_source);
+    handle->fd_direct = open(proc, O_RDONLY | O_DIRECT);
+    // not every filesystem supports O_DIRECT, reads then use the cache
+    if (handle->fd_direct < 0 && errno != EINVAL) {
+      rc = -errno;
+      patch_cache_release(&cache, handle->patch);
+      close(handle->fd_source);
+      return rc;
+    }
+  }
+  return 0;
+}
+
+static void release_handle(struct patch_handle *handle) {
+  if (handle->fd_source < 0) {
+    close(handle->fd_raw);
+  } else {
+    patch_cache_release(&cache, handle->patch);
     close(handle->fd_source);
+    if (handle->fd_direct >= 0)
+      close(handle->fd_direct);
+  }
+  free(handle);
+}
+
+// records the files behind an open, returns whether they differ from those
+// of the previous open so pages the kernel cached may be stale
+static int version_changed(struct inode *inode,
+                           struct patch_handle *handle) {
+  struct patch_key key;
+  if (handle->fd_source >= 0)
+    key = handle->patch->key;
+  else if (patch_key_make(&key, -1, handle->fd_raw) < 0)
+    return 1;
+
+  pthread_mutex_lock(&inode->lock);
+  // a fresh inode has nothing cached yet
+  int changed = inode->version.ino != 0 &&
+                !patch_key_equal(&inode->version, &key);
+  inode->version = key;
+  pthread_mutex_unlock(&inode->lock);
+  return changed;
+}
+
+// picks passthrough or normal mode for an open, the first open of a file
+// decides and later ones keep its mode until all of them are released
+static int start_open(fuse_req_t req, struct inode *inode,
+                      struct patch_handle *handle,
+                      struct fuse_file_info *fi) {
+  int rc = 0;
+  pthread_mutex_lock(&inode->lock);
+#ifdef FUSE_CAP_PASSTHROUGH
+  struct stat st;
+  if (inode->passthrough_opens > 0) {
+    // the backing file no longer shows what a file patched or replaced
+    // since would, the open fails until the passthrough opens are gone
+    if (handle->fd_source < 0 && fstat(handle->fd_raw, &st) == 0 &&
+        st.st_dev == inode->backing_dev && st.st_ino == inode->backing_ino) {
+      handle->passthrough = 1;
+    } else {
+      DBGMSG("file changed while open in passthrough mode");
+      rc = -EBUSY;
+    }
+  } else if (handle->fd_source < 0 && inode->opens == 0 &&
+             atomic_load(&passthrough) && fstat(handle->fd_raw, &st) == 0) {
+    int backing_id = fuse_passthrough_open(req, handle->fd_raw);
+    if (backing_id > 0) {
+      inode->backing_id = backing_id;
+      inode->backing_dev = st.st_dev;
+      inode->backing_ino = st.st_ino;
+      handle->passthrough = 1;
+    } else if (errno == EPERM) {
+      atomic_store(&passthrough, 0);
+    }
+  }
+  if (handle->passthrough) {
+    fi->backing_id = inode->backing_id;
+    inode->passthrough_opens++;
+  } else if (rc == 0) {
+    inode->opens++;
+  }
+#else
+  (void)req;
+  (void)handle;
+  (void)fi;
+  inode->opens++;
+#endif
+  pthread_mutex_unlock(&inode->lock);
+  return rc;
+}
+
+// the backing file is dropped with the last passthrough open, req is NULL if
+// the open was never replied to and it is then only dropped at unmount
+static void end_open(fuse_req_t req, struct inode *inode,
+                     struct patch_handle *handle) {
+  pthread_mutex_lock(&inode->lock);
+  if (!handle->passthrough) {
+    inode->opens--;
+  } else if (--inode->passthrough_opens == 0) {
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (req)
+      fuse_passthrough_close(req, inode->backing_id);
+#endif
+    inode->backing_id = 0;
+  }
+#ifndef FUSE_CAP_PASSTHROUGH
+  (void)req;
+#endif
+  pthread_mutex_unlock(&inode->lock);
+}
+
+static void patchfs_open(fuse_req_t req, fuse_ino_t ino,
+                         struct fuse_file_info *fi) {
+  if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+    fuse_reply_err(req, EROFS);
+    return;
+  }
+
+  struct patch_handle *handle = calloc(1, sizeof(struct patch_handle));
+  if (handle == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  struct inode *inode = get_inode(ino);
+  int rc = open_handle(inode, handle);
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
     free(handle);
-    return -errno;
+    return;
   }
 
-  handle->fd_raw = -1;
+  // decoding is only needed again once the delta or base changed, without
+  // keep_cache the kernel drops the pages of the file on this open
+  int changed = version_changed(inode, handle);
+  fi->keep_cache = !changed;
+  rc = start_open(req, inode, handle, fi);
+  if (rc < 0) {
+    fuse_reply_err(req, -rc);
+    release_handle(handle);
+    return;
+  }
   fi->fh = (uint64_t)handle;
-  // can return 0 here because we do not need the fd anymore
+  if (fuse_reply_open(req, fi) < 0) {
+    end_open(NULL, inode, handle);
+    release_handle(handle);
+    return;
+  }
+  // the patched size may have changed as well, only attributes are dropped
+  // here as dropping pages could wait on reads queued behind this thread
+  if (changed)
+    fuse_lowlevel_notify_inval_inode(session, ino, -1, 0);
+}
+
+#define SEGMENTS 64
+
+// source segments are passed as fd so libfuse can splice them, data segments
+// are referenced where they are since the reply is sent before returning,
+// fills are expanded into *fillp
+static int map_reply(struct patch_handle *handle, size_t size, off_t offset,
+                     struct fuse_bufvec **bufp, uint8_t **fillp) {
+  struct target_stream *target = &handle->patch->target;
+  size_t capacity = SEGMENTS;
+  struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+                                    (capacity - 1) * sizeof(struct fuse_buf));
+  if (bufv == NULL)
+    return -ENOMEM;
+  *bufv = (struct fuse_bufvec){0};
+  *bufp = bufv;
+
+  struct segment segments[SEGMENTS];
+  size_t done = 0, fill_pos = 0;
+  while (done < size) {
+    int rc = map_range_cursor(target, &handle->cursor, offset + done,
+                              size - done, segments, SEGMENTS);
+    if (rc < 0)
+      return rc;
+    size_t num_segments = rc;
+
+    if (bufv->count + num_segments > capacity) {
+      capacity = 2 * capacity + num_segments;
+      bufv = realloc(bufv, sizeof(struct fuse_bufvec) +
+                               (capacity - 1) * sizeof(struct fuse_buf));
+      if (bufv == NULL)
+        return -ENOMEM;
+      *bufp = bufv;
+    }
+
+    for (size_t i = 0; i < num_segments; i++) {
+      struct segment *seg = &segments[i];
+      struct fuse_buf *buf = &bufv->buf[bufv->count++];
+      if (seg->source_offset != SIZE_MAX) {
+        *buf = (struct fuse_buf){.size = seg->len,
+                                 .flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK,
+                                 .fd = handle->fd_source,
+                                 .pos = seg->source_offset};
+      } else if (seg->data) {
+        *buf = (struct fuse_buf){.size = seg->len, .mem = (void *)seg->data};
+      } else {
+        if (*fillp == NULL && (*fillp = malloc(size)) == NULL)
+          return -ENOMEM;
+        memset(*fillp + fill_pos, seg->fill, seg->len);
+        *buf = (struct fuse_buf){.size = seg->len, .mem = *fillp + fill_pos};
+        fill_pos += seg->len;
+      }
+      done += seg->len;
+    }
+    if (num_segments < SEGMENTS)
+      break;
+  }
   return 0;
 }
 
-static int patchfs_read(const char *path, char *buf, size_t size, off_t offset,
-                        struct fuse_file_info *fi) {
-  (void)path;
+static void free_reader(void *reader) { source_reader_free(reader); }
+
+// direct readers also serve handles whose base could not use O_DIRECT
+static struct source_reader *thread_reader(void) {
+  struct source_reader *reader = pthread_getspecific(reader_key);
+  if (reader == NULL &&
+      source_reader_new(&reader, READER_DEPTH, config.uring_direct) == 0)
+    pthread_setspecific(reader_key, reader);
+  return reader;
+}
+
+// the source parts of the range are read with io_uring into one buffer
+static void uring_reply(fuse_req_t req, struct patch_handle *handle,
+                        struct source_reader *reader, size_t size,
+                        off_t offset) {
+  uint8_t *buf = malloc(size ? size : 1);
+  if (buf == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  int fd = handle->fd_direct >= 0 ? handle->fd_direct : handle->fd_source;
+  int rc = read_range_reader(&handle->patch->target, &handle->cursor, reader,
+                             fd, offset, size, buf);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_buf(req, (const char *)buf, rc);
+  free(buf);
+}
+
+static void patchfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                         off_t offset, struct fuse_file_info *fi) {
+  (void)ino;
   struct patch_handle *handle = (struct patch_handle *)fi->fh;
 
   if (handle->fd_source < 0) {
-    RET(pread(handle->fd_raw, buf, size, offset), return __r, )
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    buf.buf[0].fd = handle->fd_raw;
+    buf.buf[0].pos = offset;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+    return;
+  }
+
+  if (config.uring) {
+    // without a reader for this thread the mapping is used instead
+    struct source_reader *reader = thread_reader();
+    if (reader != NULL) {
+      uring_reply(req, handle, reader, size, offset);
+      return;
+    }
   }
 
-  return read_range(&handle->target, offset, size, (uint8_t *)buf);
+  struct fuse_bufvec *bufv = NULL;
+  uint8_t *fill = NULL;
+  int rc = map_reply(handle, size, offset, &bufv, &fill);
+  if (rc < 0)
+    fuse_reply_err(req, -rc);
+  else
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  free(fill);
+  free(bufv);
 }
 
-static int patchfs_write(const char *path, const char *buf, size_t size,
-                         off_t offset, struct fuse_file_info *fi) {
-  (void)path;
+static void patchfs_write(fuse_req_t req, fuse_ino_t ino, const char *buf,
+                          size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+  (void)ino;
   (void)buf;
   (void)size;
   (void)offset;
   (void)fi;
-  return -EROFS;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_release(const char *path, struct fuse_file_info *finfo) {
-  (void)path;
-  struct patch_handle *handle = (struct patch_handle *)finfo->fh;
-  int rc;
-
-  if (handle->fd_source < 0) {
-    rc = close(handle->fd_raw);
-    if (rc < 0)
-      return -errno;
-  } else {
-    rc = free_data(&handle->target, &handle->source);
-    if (rc < 0)
-      return -errno;
-    rc = close(handle->fd_source);
-    if (rc < 0)
-      return -errno;
-  }
-  free(handle);
-
-  return 0;
+static void patchfs_release(fuse_req_t req, fuse_ino_t ino,
+                            struct fuse_file_info *fi) {
+  struct patch_handle *handle = (struct patch_handle *)fi->fh;
+  end_open(req, get_inode(ino), handle);
+  release_handle(handle);
+  fuse_reply_err(req, 0);
 }
 
-static int patchfs_statfs(const char *path, struct statvfs *stbuf) {
-  SRC(path)
-  RET(statvfs(path, stbuf), , )
+static void patchfs_statfs(fuse_req_t req, fuse_ino_t ino) {
+  struct statvfs stbuf;
+  if (fstatvfs(get_inode(ino)->fd, &stbuf) < 0)
+    fuse_reply_err(req, errno);
+  else
+    fuse_reply_statfs(req, &stbuf);
 }
 
-static int patchfs_setxattr(const char *path, const char *name,
-                            const char *value, size_t size, int flags) {
-  (void)path;
+static void patchfs_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                             const char *value, size_t size, int flags) {
+  (void)ino;
   (void)name;
   (void)value;
   (void)size;
   (void)flags;
-  return -EROFS;
+  fuse_reply_err(req, EROFS);
 }
 
-static int patchfs_getxattr(const char *path, const char *name, char *value,
-                            size_t size) {
-  SRC(path)
-  RET(lgetxattr(path, name, value, size), , )
+// replies with the size if size is 0, with the value otherwise
+static void reply_xattr(fuse_req_t req, ssize_t length, const char *value,
+                        size_t size) {
+  if (length < 0)
+    fuse_reply_err(req, errno);
+  else if (size == 0)
+    fuse_reply_xattr(req, length);
+  else
+    fuse_reply_buf(req, value, length);
 }
 
-static int patchfs_listxattr(const char *path, char *list, size_t size) {
-  SRC(path)
-  RET(llistxattr(path, list, size), , )
+static void patchfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name,
+                             size_t size) {
+  // the proc link of an O_PATH descriptor resolves to the file itself, for
+  // symlinks as well, so their own xattrs are read and not the target's
+  char proc[32];
+  proc_path(proc, get_inode(ino)->fd);
+  char *value = NULL;
+  if (size > 0 && (value = malloc(size)) == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  reply_xattr(req, getxattr(proc, name, value, size), value, size);
+  free(value);
+}
+
+static void patchfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size) {
+  char proc[32];
+  proc_path(proc, get_inode(ino)->fd);
+  char *list = NULL;
+  if (size > 0 && (list = malloc(size)) == NULL) {
+    fuse_reply_err(req, ENOMEM);
+    return;
+  }
+  reply_xattr(req, listxattr(proc, list, size), list, size);
+  free(list);
 }
 
-static int patchfs_removexattr(const char *path, const char *name) {
-  (void)path;
+static void patchfs_removexattr(fuse_req_t req, fuse_ino_t ino,
+                                const char *name) {
+  (void)ino;
   (void)name;
-  return -EROFS;
+  fuse_reply_err(req, EROFS);
+}
+
+static void patchfs_init(void *userdata, struct fuse_conn_info *conn) {
+  (void)userdata;
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  if (conn->capable & FUSE_CAP_SPLICE_MOVE)
+    conn->want |= FUSE_CAP_SPLICE_MOVE;
+#ifdef FUSE_CAP_PASSTHROUGH
+  // unpatched files are then read by the kernel without a round trip
+  if (conn->capable & FUSE_CAP_PASSTHROUGH) {
+    conn->want |= FUSE_CAP_PASSTHROUGH;
+    atomic_store(&passthrough, 1);
+  }
+#endif
+  // started here since the session may fork into the background
+  if (config.cache_timeout > 0 && patch_cache_start(&cache) < 0)
+    fprintf(stderr, "Failed to start patch cache reaper\n");
+}
+
+static void patchfs_destroy(void *userdata) {
+  (void)userdata;
+  patch_cache_destroy(&cache);
 }
 
 #define OP(x) .x = patchfs_##x,
 
-static struct fuse_operations patchfs_oper = {
-    OP(getattr) OP(access) OP(readlink) OP(readdir) OP(mknod) OP(mkdir)
-        OP(symlink) OP(unlink) OP(rmdir) OP(rename) OP(link) OP(chmod) OP(chown)
-            OP(truncate) OP(utimens) OP(open) OP(read) OP(write) OP(release)
-                OP(statfs) OP(setxattr) OP(getxattr) OP(listxattr)
-                    OP(removexattr)};
+static const struct fuse_lowlevel_ops patchfs_oper = {
+    OP(init) OP(destroy) OP(lookup) OP(forget) OP(forget_multi) OP(getattr)
+        OP(setattr) OP(readlink) OP(mknod) OP(mkdir) OP(unlink) OP(rmdir)
+            OP(symlink) OP(rename) OP(link) OP(open) OP(read) OP(write)
+                OP(release) OP(opendir) OP(readdir) OP(readdirplus)
+                    OP(releasedir) OP(statfs) OP(setxattr) OP(getxattr)
+                        OP(listxattr) OP(removexattr) OP(create)};
 
 enum {
   KEY_HELP,
@@ -355,10 +1113,35 @@ static void usage(const char *progname) {
           "\n"
           "general options:\n"
           "   -o base=source,[opt...]     mount options\n"
+          "   -o index=DIR                directory mirroring readwritepath\n"
+          "                               with precompiled block indexes\n"
+          "   -o manifest=FILE            sizes of patched files written by\n"
+          "                               vcdiff-manifest\n"
+          "   -o cache_timeout=N          keep decoded patches for N seconds\n"
+          "                               after last close (default: 30)\n"
+          "   -o cache_size=N             decoded patch cache limit in MiB\n"
+          "                               (default: 256)\n"
+          "   -o lazy                     decode diff windows on first read\n"
+          "   -o background               decode diffs in the background,\n"
+          "                               reads wait for their range only\n"
+          "   -o base_populate            read base files completely when\n"
+          "                               they are first mapped\n"
+          "   -o base_hugepages           map base files with huge pages\n"
+          "                               where the kernel supports it\n"
+          "   -o uring                    read base files with io_uring\n"
+          "                               instead of faulting in mappings\n"
+          "   -o uring_direct             like uring, bypassing the page\n"
+          "                               cache with O_DIRECT\n"
+          "   -o entry_timeout=T          cache name lookups for T seconds\n"
+          "                               (default: 1.0)\n"
+          "   -o attr_timeout=T           cache attributes for T seconds\n"
+          "                               (default: 1.0)\n"
           "   -h  --help                 print help\n"
           "   -V  --version              print version\n"
           "\n",
           progname);
+  fuse_cmdline_help();
+  fuse_lowlevel_help();
 }
 
 static int patchfs_parse_opt(void *data, const char *arg, int key,
@@ -368,7 +1151,11 @@ static int patchfs_parse_opt(void *data, const char *arg, int key,
   switch (key) {
   case FUSE_OPT_KEY_NONOPT:
     if (src == 0) {
-      src = strdup(arg);
+      src = realpath(arg, NULL);
+      if (src == NULL) {
+        fprintf(stderr, "Invalid readwritepath %s\n", arg);
+        exit(1);
+      }
       src_len = strlen(src);
       return 0;
     } else
@@ -380,6 +1167,7 @@ static int patchfs_parse_opt(void *data, const char *arg, int key,
     exit(0);
   case KEY_VERSION:
     fprintf(stdout, "patchFs version %s\n", patchFsVersion);
+    fuse_lowlevel_version();
     exit(0);
   default:
     fprintf(stderr, "see `%s -h' for usage\n", outargs->argv[0]);
@@ -388,19 +1176,83 @@ static int patchfs_parse_opt(void *data, const char *arg, int key,
   return 1;
 }
 
-static struct fuse_opt patchfs_opts[] = {FUSE_OPT_KEY("-h", KEY_HELP),
-                                         FUSE_OPT_KEY("--help", KEY_HELP),
-                                         FUSE_OPT_KEY("-V", KEY_VERSION),
-                                         FUSE_OPT_KEY("--version", KEY_VERSION),
-                                         {"base=%s", 0, 0},
-                                         FUSE_OPT_END};
+#define PATCHFS_OPT(t, p, v)                                                   \
+  { t, offsetof(struct patchfs_config, p), v }
+
+static struct fuse_opt patchfs_opts[] = {
+    FUSE_OPT_KEY("-h", KEY_HELP),
+    FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_KEY("-V", KEY_VERSION),
+    FUSE_OPT_KEY("--version", KEY_VERSION),
+    PATCHFS_OPT("base=%s", base, 0),
+    PATCHFS_OPT("index=%s", index, 0),
+    PATCHFS_OPT("manifest=%s", manifest, 0),
+    PATCHFS_OPT("cache_timeout=%u", cache_timeout, 0),
+    PATCHFS_OPT("cache_size=%lu", cache_size, 0),
+    PATCHFS_OPT("lazy", lazy, 1),
+    PATCHFS_OPT("background", background, 1),
+    PATCHFS_OPT("base_populate", base_populate, 1),
+    PATCHFS_OPT("base_hugepages", base_hugepages, 1),
+    PATCHFS_OPT("uring", uring, 1),
+    PATCHFS_OPT("uring_direct", uring_direct, 1),
+    PATCHFS_OPT("entry_timeout=%lf", entry_timeout, 0),
+    PATCHFS_OPT("attr_timeout=%lf", attr_timeout, 0),
+    FUSE_OPT_END};
+
+static int open_dirs(void) {
+  root.fd = open(src, O_PATH | O_DIRECTORY);
+  if (root.fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", src, strerror(errno));
+    return -1;
+  }
+  struct stat st;
+  if (fstat(root.fd, &st) < 0)
+    return -1;
+  root.type = S_IFDIR;
+  root.dev = st.st_dev;
+  root.ino = st.st_ino;
+  root.nlookup = 1;
+  root.size_ctime.tv_nsec = -1;
+  pthread_mutex_init(&root.lock, NULL);
+  // so lookups of the root through .. find this inode
+  if (tsearch(&root, &inodes, compare_inodes) == NULL)
+    return -1;
+
+  base_fd = open(config.base, O_PATH | O_DIRECTORY);
+  if (base_fd < 0) {
+    fprintf(stderr, "Failed to open %s: %s\n", config.base, strerror(errno));
+    return -1;
+  }
+  if (config.manifest != NULL) {
+    int fd = open(config.manifest, O_RDONLY);
+    int rc = fd < 0 ? -errno : manifest_load(&manifest, fd);
+    if (fd >= 0)
+      close(fd);
+    if (rc < 0) {
+      fprintf(stderr, "Failed to load manifest %s: %s\n", config.manifest,
+              strerror(-rc));
+      return -1;
+    }
+    root.path = strdup("");
+  }
+  if (config.index != NULL) {
+    index_fd = open(config.index, O_PATH | O_DIRECTORY);
+    if (index_fd < 0) {
+      fprintf(stderr, "Failed to open %s: %s\n", config.index,
+              strerror(errno));
+      return -1;
+    }
+  }
+  return 0;
+}
 
 int main(int argc, char *argv[]) {
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+  struct fuse_cmdline_opts opts;
   int res;
 
-  res = fuse_opt_parse(&args, &base, patchfs_opts, patchfs_parse_opt);
-  if (res != 0) {
+  res = fuse_opt_parse(&args, &config, patchfs_opts, patchfs_parse_opt);
+  if (res != 0 || fuse_parse_cmdline(&args, &opts) != 0) {
     fprintf(stderr, "Invalid arguments\n");
     fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
     exit(1);
@@ -410,23 +1262,81 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
     exit(1);
   }
-  if (base == 0) {
+  if (opts.mountpoint == NULL) {
+    fprintf(stderr, "Missing mountpoint\n");
+    fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
+    exit(1);
+  }
+  if (config.base == 0) {
     fprintf(stderr, "Missing basedir\n");
     fprintf(stderr, "see `%s -h' for usage\n", argv[0]);
     exit(1);
   }
-  base_len = strlen(base);
-  if (base[base_len - 1] != '/') {
-    if (base_len >= PATH_MAX) {
-      fprintf(stderr, "basedir too long\n");
+  if (open_dirs() < 0)
+    exit(1);
+
+  if (config.uring_direct)
+    config.uring = 1;
+  if (config.uring) {
+    struct source_reader *reader;
+    int rc = source_reader_new(&reader, READER_DEPTH, config.uring_direct);
+    if (rc < 0) {
+      fprintf(stderr, "io_uring not available: %s\n", strerror(-rc));
       exit(1);
     }
-    base[base_len] = '/';
-    base[base_len + 1] = '\0';
-    base_len++;
+    source_reader_free(reader);
+    pthread_key_create(&reader_key, free_reader);
   }
 
-  fuse_main(args.argc, args.argv, &patchfs_oper, NULL);
+  set_source_map_flags(
+      (config.base_populate ? SOURCE_MAP_POPULATE : 0) |
+      (config.base_hugepages ? SOURCE_MAP_HUGEPAGE : 0));
 
-  return 0;
+  if (patch_cache_init(&cache, config.cache_timeout,
+                       config.cache_size * 1024 * 1024, config.lazy,
+                       config.background) < 0) {
+    fprintf(stderr, "Failed to initialize patch cache\n");
+    exit(1);
+  }
+
+  // permissions are checked by the kernel against the mirrored attributes
+  fuse_opt_add_arg(&args, "-odefault_permissions");
+
+  res = 1;
+  struct fuse_session *se =
+      fuse_session_new(&args, &patchfs_oper, sizeof(patchfs_oper), NULL);
+  session = se;
+  if (se == NULL)
+    goto out;
+  if (fuse_set_signal_handlers(se) != 0)
+    goto out_session;
+  if (fuse_session_mount(se, opts.mountpoint) != 0)
+    goto out_signals;
+
+  if (fuse_daemonize(opts.foreground) != 0) {
+    fprintf(stderr, "Failed to daemonize\n");
+    goto out_unmount;
+  }
+  if (opts.singlethread) {
+    res = fuse_session_loop(se);
+  } else {
+    struct fuse_loop_config *loop = fuse_loop_cfg_create();
+    fuse_loop_cfg_set_clone_fd(loop, opts.clone_fd);
+    if (opts.max_idle_threads != UINT_MAX)
+      fuse_loop_cfg_set_idle_threads(loop, opts.max_idle_threads);
+    fuse_loop_cfg_set_max_threads(loop, opts.max_threads);
+    res = fuse_session_loop_mt(se, loop);
+    fuse_loop_cfg_destroy(loop);
+  }
+
+out_unmount:
+  fuse_session_unmount(se);
+out_signals:
+  fuse_remove_signal_handlers(se);
+out_session:
+  fuse_session_destroy(se);
+out:
+  free(opts.mountpoint);
+  fuse_opt_free_args(&args);
+  return res ? 1 : 0;
 }
@@ -0,0 +1,57 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vcdiff_incremental.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "Usage: %s [dict] [delta] [index]\n", argv[0]);
+    return 1;
+  }
+
+  int source_fd = open(argv[1], O_RDONLY);
+  if (source_fd < 0) {
+    perror("Error opening dict");
+    return 1;
+  }
+  int delta_fd = open(argv[2], O_RDONLY);
+  if (delta_fd < 0) {
+    perror("Error opening delta");
+    return 1;
+  }
+
+  struct target_stream target;
+  struct source_stream source;
+
+  int rc = load_diff(&target, &source, source_fd, delta_fd);
+  if (rc < 0) {
+    fprintf(stderr, "Error loading diff: %s\n", strerror(-rc));
+    goto end;
+  }
+
+  int index_fd = open(argv[3], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (index_fd < 0) {
+    perror("Error opening index");
+    rc = 1;
+    goto exit;
+  }
+
+  rc = write_index(&target, &source, source_fd, delta_fd, index_fd);
+  if (rc < 0) {
+    fprintf(stderr, "Error writing index: %s\n", strerror(-rc));
+    close(index_fd);
+    unlink(argv[3]);
+    goto exit;
+  }
+
+  rc = close(index_fd);
+  if (rc < 0)
+    perror("Error closing index");
+
+exit:
+  free_data(&target, &source);
+end:
+  return rc < 0 ? 1 : rc;
+}
@@ -0,0 +1,32 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "manifest.h"
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s [diffdir] [manifest]\n", argv[0]);
+    return 1;
+  }
+
+  int manifest_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (manifest_fd < 0) {
+    perror("Error opening manifest");
+    return 1;
+  }
+
+  int rc = manifest_build(argv[1], manifest_fd);
+  if (rc < 0) {
+    fprintf(stderr, "Error building manifest: %s\n", strerror(-rc));
+    close(manifest_fd);
+    unlink(argv[2]);
+    return 1;
+  }
+
+  rc = close(manifest_fd);
+  if (rc < 0)
+    perror("Error closing manifest");
+  return rc < 0 ? 1 : 0;
+}
@@ -1,40 +1,331 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
 #include "vcdiff_incremental.h"
 
-#define BUFSIZE 1024 * 1024
+// target bytes mapped at once
+#define CHUNK (16 * 1024 * 1024)
+#define SEGMENTS 256
+#define FILL_LEN (64 * 1024)
+// target bytes a thread reconstructs at a time
+#define STRIPE (64 * 1024 * 1024)
+#define MAX_THREADS 256
+
+// memory and fill pieces waiting to be written with one writev
+struct output {
+  int fd;
+  // where the next write goes in the file, -1 to write at its position
+  off_t pos;
+  struct iovec iov[IOV_MAX];
+  int count;
+  // fills are written from one buffer per fill byte, repeated as needed
+  uint8_t *fills[256];
+};
+
+static void advance(struct output *out, size_t n) {
+  if (out->pos >= 0)
+    out->pos += n;
+}
+
+static int flush(struct output *out) {
+  struct iovec *iov = out->iov;
+  int count = out->count;
+  out->count = 0;
+  while (count > 0) {
+    ssize_t n = out->pos >= 0 ? pwritev(out->fd, iov, count, out->pos)
+                              : writev(out->fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    advance(out, n);
+    for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--)
+      n -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+static int push(struct output *out, const void *data, size_t len) {
+  if (out->count == IOV_MAX) {
+    int rc = flush(out);
+    if (rc < 0)
+      return rc;
+  }
+  out->iov[out->count++] =
+      (struct iovec){.iov_base = (void *)data, .iov_len = len};
+  return 0;
+}
+
+static int push_fill(struct output *out, uint8_t byte, size_t len) {
+  if (out->fills[byte] == NULL) {
+    out->fills[byte] = malloc(FILL_LEN);
+    if (out->fills[byte] == NULL)
+      return -ENOMEM;
+    memset(out->fills[byte], byte, FILL_LEN);
+  }
+  while (len > 0) {
+    size_t n = len < FILL_LEN ? len : FILL_LEN;
+    int rc = push(out, out->fills[byte], n);
+    if (rc < 0)
+      return rc;
+    len -= n;
+  }
+  return 0;
+}
+
+static atomic_int no_copy_range, no_sendfile;
+
+// source pieces are copied between the files in the kernel where possible,
+// copy_file_range needs a regular file as output, sendfile works for pipes
+static int copy_source(struct output *out, const struct segment *segment) {
+  off_t offset = segment->source_offset;
+  size_t left = segment->len;
+  while (left > 0) {
+    const uint8_t *data = segment->data + (offset - segment->source_offset);
+    ssize_t n;
+    if (!atomic_load(&no_copy_range)) {
+      n = copy_file_range(segment->fd, &offset, out->fd,
+                          out->pos >= 0 ? &out->pos : NULL, left, 0);
+      if (n < 0 && (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+                    errno == EBADF)) {
+        atomic_store(&no_copy_range, 1);
+        continue;
+      }
+    } else if (out->pos < 0 && !atomic_load(&no_sendfile)) {
+      n = sendfile(out->fd, segment->fd, &offset, left);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        atomic_store(&no_sendfile, 1);
+        continue;
+      }
+    } else {
+      n = out->pos >= 0 ? pwrite(out->fd, data, left, out->pos)
+                        : write(out->fd, data, left);
+      if (n > 0) {
+        offset += n;
+        advance(out, n);
+      }
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    if (n == 0)
+      return -EIO;
+    left -= n;
+  }
+  return 0;
+}
+
+// writes target bytes from start to end, segments point into the decoded
+// diff and the base, nothing is copied into a buffer of our own
+static int write_range(struct target_stream *target, struct output *out,
+                       size_t start, size_t end) {
+  struct segment segments[SEGMENTS];
+  struct read_cursor cursor = {0};
+  size_t offset = start;
+  while (offset < end) {
+    size_t len = end - offset < CHUNK ? end - offset : CHUNK;
+    int rc = map_range_cursor(target, &cursor, offset, len, segments,
+                              SEGMENTS);
+    // a target that maps short of its length is a corrupt delta
+    if (rc == 0)
+      rc = -EIO;
+    if (rc < 0)
+      return rc;
+    size_t num_segments = rc;
+    for (size_t i = 0; i < num_segments; i++) {
+      struct segment *segment = &segments[i];
+      if (segment->source_offset != SIZE_MAX) {
+        rc = flush(out);
+        if (rc >= 0)
+          rc = copy_source(out, segment);
+      } else if (segment->data) {
+        rc = push(out, segment->data, segment->len);
+      } else {
+        rc = push_fill(out, segment->fill, segment->len);
+      }
+      if (rc < 0)
+        return rc;
+      offset += segment->len;
+    }
+  }
+  return flush(out);
+}
+
+// threads take stripes of the range in order and write them in place
+struct job {
+  struct target_stream *target;
+  int fd;
+  size_t start, end;
+  atomic_size_t next;
+  atomic_int error;
+};
+
+static void *reconstruct(void *arg) {
+  struct job *job = arg;
+  struct output *out = calloc(1, sizeof(struct output));
+  if (out == NULL) {
+    atomic_store(&job->error, -ENOMEM);
+    return NULL;
+  }
+  out->fd = job->fd;
+
+  for (;;) {
+    size_t stripe = atomic_fetch_add(&job->next, 1);
+    if (stripe >= (job->end - job->start + STRIPE - 1) / STRIPE ||
+        atomic_load(&job->error))
+      break;
+    size_t start = job->start + stripe * STRIPE;
+    size_t end = job->end - start > STRIPE ? start + STRIPE : job->end;
+    out->pos = start - job->start;
+    int rc = write_range(job->target, out, start, end);
+    if (rc < 0) {
+      atomic_store(&job->error, rc);
+      break;
+    }
+  }
+  for (int i = 0; i < 256; i++)
+    free(out->fills[i]);
+  free(out);
+  return NULL;
+}
+
+static int write_file(struct job *job, const char *path, unsigned threads) {
+  job->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (job->fd < 0)
+    return -errno;
+
+  // allocated up front so parallel writes do not fragment the file
+  off_t len = job->end - job->start;
+  if ((len > 0 && fallocate(job->fd, 0, 0, len) < 0 &&
+       errno != EOPNOTSUPP) ||
+      ftruncate(job->fd, len) < 0) {
+    int rc = -errno;
+    close(job->fd);
+    return rc;
+  }
+
+  pthread_t workers[MAX_THREADS];
+  unsigned started = 0;
+  while (started + 1 < threads &&
+         pthread_create(&workers[started], NULL, reconstruct, job) == 0)
+    started++;
+  reconstruct(job);
+  for (unsigned i = 0; i < started; i++)
+    pthread_join(workers[i], NULL);
+
+  int rc = atomic_load(&job->error);
+  if (close(job->fd) < 0 && rc == 0)
+    rc = -errno;
+  return rc;
+}
+
+static int parse_size(const char *arg, size_t *value) {
+  char *end;
+  errno = 0;
+  unsigned long long parsed = strtoull(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-')
+    return -1;
+  *value = parsed;
+  return 0;
+}
+
+static void usage(const char *progname) {
+  fprintf(stderr,
+          "Usage: %s [--offset N] [--length N] [--output FILE "
+          "[--threads N]] [dict] < [delta]\n",
+          progname);
+}
 
 int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s [dict]\n", argv[0]);
+  static const struct option options[] = {
+      {"offset", required_argument, NULL, 's'},
+      {"length", required_argument, NULL, 'l'},
+      {"output", required_argument, NULL, 'o'},
+      {"threads", required_argument, NULL, 't'},
+      {0}};
+  size_t offset = 0, length = SIZE_MAX, threads = 1;
+  const char *output = NULL;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+    int rc = -1;
+    if (opt == 's')
+      rc = parse_size(optarg, &offset);
+    else if (opt == 'l')
+      rc = parse_size(optarg, &length);
+    else if (opt == 't')
+      rc = parse_size(optarg, &threads);
+    else if (opt == 'o')
+      output = optarg, rc = 0;
+    if (rc < 0 || threads == 0 || threads > MAX_THREADS) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (argc - optind != 1 || (threads > 1 && output == NULL)) {
+    usage(argv[0]);
     return 1;
   }
 
-  int source_fd = open(argv[1], O_RDONLY);
+  int source_fd = open(argv[optind], O_RDONLY);
+  if (source_fd < 0) {
+    fprintf(stderr, "Error opening %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
 
   struct target_stream target;
   struct source_stream source;
 
-  int rc = load_diff(&target, &source, source_fd, STDIN_FILENO);
+  // for a range only the windows covering it are decoded, that needs the
+  // delta mapped so a pipe falls back to decoding all of it
+  int rc = -ENOTSUP;
+  if (offset > 0 || length != SIZE_MAX)
+    rc = load_diff_lazy(&target, &source, source_fd, STDIN_FILENO);
+  if (rc < 0)
+    rc = load_diff(&target, &source, source_fd, STDIN_FILENO);
   if (rc < 0) {
     fprintf(stderr, "Error loading diff: %s\n", strerror(-rc));
     goto end;
   }
 
-  uint8_t buf[BUFSIZE];
-  size_t read, offset = 0;
-  do {
-    read = read_range(&target, offset, BUFSIZE, buf);
-    rc = write(STDOUT_FILENO, buf, read);
+  size_t start = offset < target.offset ? offset : target.offset;
+  size_t end = length < target.offset - start ? start + length : target.offset;
+  if (output) {
+    struct job job = {.target = &target, .start = start, .end = end};
+    rc = write_file(&job, output, threads);
+    if (rc < 0) {
+      fprintf(stderr, "Error writing %s: %s\n", output, strerror(-rc));
+      goto exit;
+    }
+  } else {
+    static struct output out = {.fd = STDOUT_FILENO, .pos = -1};
+    rc = write_range(&target, &out, start, end);
+    for (int i = 0; i < 256; i++)
+      free(out.fills[i]);
     if (rc < 0) {
       fprintf(stderr, "Error writing to stdout: %s\n", strerror(-rc));
       goto exit;
     }
-    offset += read;
-  } while (read == BUFSIZE);
+  }
 
   rc = 0;
 exit:
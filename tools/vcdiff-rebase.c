@@ -0,0 +1,573 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/xattr.h>
+
+#include "vcdiff_incremental.h"
+#include "window_encoder.h"
+
+// target bytes per window, the same as the encoder uses
+#define WINDOW (4 * 1024 * 1024)
+#define SEGMENTS 256
+
+// the open-vcdiff interleaved format, as written by the encoder
+static const uint8_t file_header[] = {0xd6, 0xc3, 0xc4, 'S', 0x00};
+
+#define VCD_SOURCE 0x01
+
+// opcodes of the default code table with the size given separately
+#define OP_RUN 0
+#define OP_ADD 1
+#define OP_COPY 19
+
+enum op_type { OP_NONE, OP_TYPE_RUN, OP_TYPE_ADD, OP_TYPE_COPY };
+
+// the instruction being built, continued as long as pieces extend it
+struct op {
+  enum op_type type;
+  size_t len;
+  const uint8_t *data;
+  size_t address;
+  uint8_t byte;
+};
+
+struct writer {
+  int fd;
+  size_t source_len;
+  // the interleaved instructions of the window being built
+  uint8_t *inst;
+  size_t inst_len;
+  size_t inst_capacity;
+  size_t target_len;
+  struct op op;
+  // bytes of the window being built and of the windows written
+  size_t window_copied, window_added;
+  size_t copied, added;
+};
+
+// old base ranges that are also in the new base, sorted and disjoint
+struct moved {
+  size_t old_pos;
+  size_t new_pos;
+  size_t len;
+};
+
+struct rebase {
+  struct writer out;
+  const uint8_t *old_data;
+  size_t old_len;
+  // set if ranges are looked up in moved, compared with new_data otherwise
+  struct moved *moved;
+  size_t num_moved;
+  const uint8_t *new_data;
+  size_t new_len;
+  // set once a source range of the window has no place in the new base
+  int broken;
+  // windows that are broken are encoded again against the new base, the
+  // dictionary is only hashed for the first of them
+  struct window_encoder *encoder;
+  uint8_t *window;
+  size_t reencoded, num_reencoded;
+};
+
+static size_t put_varint(uint8_t *dest, size_t value) {
+  uint8_t buf[10];
+  size_t len = 0;
+  do {
+    buf[len++] = value & 0x7f;
+    value >>= 7;
+  } while (value);
+  for (size_t i = 0; i < len; i++)
+    dest[i] = buf[len - 1 - i] | (i + 1 < len ? 0x80 : 0);
+  return len;
+}
+
+static int write_all(int fd, struct iovec *iov, int count) {
+  while (count > 0) {
+    ssize_t n = writev(fd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    for (; count > 0 && (size_t)n >= iov->iov_len; iov++, count--)
+      n -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = (uint8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+static int reserve(struct writer *out, size_t len) {
+  if (out->inst_capacity - out->inst_len >= len)
+    return 0;
+  size_t capacity = 2 * out->inst_capacity + len;
+  uint8_t *inst = realloc(out->inst, capacity);
+  if (inst == NULL)
+    return -ENOMEM;
+  out->inst = inst;
+  out->inst_capacity = capacity;
+  return 0;
+}
+
+static void discard_window(struct writer *out) {
+  out->op = (struct op){0};
+  out->inst_len = 0;
+  out->target_len = 0;
+  out->window_copied = 0;
+  out->window_added = 0;
+}
+
+static int flush_window(struct writer *out) {
+  if (out->target_len == 0)
+    return 0;
+
+  // the delta encoding starts with its target length and section lengths,
+  // everything is in the instruction section in the interleaved format
+  uint8_t encoding[32];
+  size_t encoding_len = put_varint(encoding, out->target_len);
+  encoding[encoding_len++] = 0;
+  encoding_len += put_varint(encoding + encoding_len, 0);
+  encoding_len += put_varint(encoding + encoding_len, out->inst_len);
+  encoding_len += put_varint(encoding + encoding_len, 0);
+
+  uint8_t header[32];
+  size_t header_len = 0;
+  if (out->source_len > 0) {
+    header[header_len++] = VCD_SOURCE;
+    header_len += put_varint(header + header_len, out->source_len);
+    header_len += put_varint(header + header_len, 0);
+  } else {
+    header[header_len++] = 0;
+  }
+  header_len +=
+      put_varint(header + header_len, encoding_len + out->inst_len);
+
+  struct iovec iov[] = {{header, header_len},
+                        {encoding, encoding_len},
+                        {out->inst, out->inst_len}};
+  int rc = write_all(out->fd, iov, 3);
+  out->copied += out->window_copied;
+  out->added += out->window_added;
+  discard_window(out);
+  return rc;
+}
+
+// appends op to the window, windows are built one at a time so it never
+// crosses into the next one
+static int put_op(struct writer *out, const struct op *op) {
+  int rc = reserve(out, 1 + 10 + 10 + (op->type == OP_TYPE_ADD ? op->len : 1));
+  if (rc < 0)
+    return rc;
+
+  uint8_t *inst = out->inst + out->inst_len;
+  if (op->type == OP_TYPE_RUN) {
+    *inst++ = OP_RUN;
+    inst += put_varint(inst, op->len);
+    *inst++ = op->byte;
+  } else if (op->type == OP_TYPE_ADD) {
+    *inst++ = OP_ADD;
+    inst += put_varint(inst, op->len);
+    memcpy(inst, op->data, op->len);
+    inst += op->len;
+  } else {
+    // mode 0 addresses are plain offsets into the source segment
+    *inst++ = OP_COPY;
+    inst += put_varint(inst, op->len);
+    inst += put_varint(inst, op->address);
+  }
+  out->inst_len = inst - out->inst;
+  out->target_len += op->len;
+  return 0;
+}
+
+static int flush_op(struct writer *out) {
+  struct op op = out->op;
+  out->op = (struct op){0};
+  if (op.type == OP_NONE)
+    return 0;
+  if (op.type == OP_TYPE_COPY)
+    out->window_copied += op.len;
+  else
+    out->window_added += op.len;
+  return put_op(out, &op);
+}
+
+// continues the pending instruction if next extends it
+static int push_op(struct writer *out, struct op next) {
+  struct op *op = &out->op;
+  int extends =
+      op->type == next.type &&
+      (next.type == OP_TYPE_RUN    ? op->byte == next.byte
+       : next.type == OP_TYPE_ADD  ? op->data + op->len == next.data
+                                   : op->address + op->len == next.address);
+  if (extends) {
+    op->len += next.len;
+    return 0;
+  }
+  int rc = flush_op(out);
+  *op = next;
+  return rc;
+}
+
+static int push_copy(struct writer *out, size_t address, size_t len) {
+  return push_op(out, (struct op){
+                          .type = OP_TYPE_COPY, .len = len, .address = address});
+}
+
+static int push_add(struct writer *out, const uint8_t *data, size_t len) {
+  return push_op(out,
+                 (struct op){.type = OP_TYPE_ADD, .len = len, .data = data});
+}
+
+// index of the first moved range ending after pos
+static size_t find_moved(const struct rebase *rebase, size_t pos) {
+  size_t left = 0, right = rebase->num_moved;
+  while (left < right) {
+    size_t mid = (left + right) / 2;
+    const struct moved *moved = &rebase->moved[mid];
+    if (moved->old_pos + moved->len <= pos)
+      left = mid + 1;
+    else
+      right = mid;
+  }
+  return left;
+}
+
+// copies an old base range from where the diff between the bases put it,
+// the window is broken if part of the range did not make it into the new base
+static int push_moved(struct rebase *rebase, size_t pos, size_t len) {
+  while (len > 0) {
+    size_t i = find_moved(rebase, pos);
+    const struct moved *moved = &rebase->moved[i];
+    if (i == rebase->num_moved || moved->old_pos > pos) {
+      rebase->broken = 1;
+      return 0;
+    }
+    size_t n = moved->old_pos + moved->len - pos;
+    if (n > len)
+      n = len;
+    int rc =
+        push_copy(&rebase->out, moved->new_pos + (pos - moved->old_pos), n);
+    if (rc < 0)
+      return rc;
+    pos += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// without a diff between the bases, an old range is only found again if it
+// is unchanged at the same offset of the new base
+static int push_same(struct rebase *rebase, size_t pos, size_t len) {
+  if (pos > rebase->new_len || len > rebase->new_len - pos ||
+      memcmp(rebase->old_data + pos, rebase->new_data + pos, len) != 0) {
+    rebase->broken = 1;
+    return 0;
+  }
+  return push_copy(&rebase->out, pos, len);
+}
+
+static int push_segment(struct rebase *rebase,
+                        const struct segment *segment) {
+  if (segment->source_offset != SIZE_MAX) {
+    if (rebase->moved)
+      return push_moved(rebase, segment->source_offset, segment->len);
+    return push_same(rebase, segment->source_offset, segment->len);
+  }
+  if (segment->data)
+    return push_add(&rebase->out, segment->data, segment->len);
+  return push_op(&rebase->out, (struct op){.type = OP_TYPE_RUN,
+                                           .len = segment->len,
+                                           .byte = segment->fill});
+}
+
+static int compare_moved(const void *a, const void *b) {
+  const struct moved *x = a, *y = b;
+  if (x->old_pos != y->old_pos)
+    return x->old_pos < y->old_pos ? -1 : 1;
+  return x->len > y->len ? -1 : x->len < y->len;
+}
+
+// inverts the source blocks of the diff between the bases, so old ranges can
+// be looked up in the new base
+static int build_moved(struct rebase *rebase, struct target_stream *bases) {
+  const struct block_index *index = &bases->index;
+  rebase->moved = malloc((index->num_blocks + 1) * sizeof(struct moved));
+  if (rebase->moved == NULL)
+    return -ENOMEM;
+
+  size_t num_moved = 0;
+  for (size_t i = 0; i < index->num_blocks; i++) {
+    uint64_t ref = index->ref[i];
+    size_t len = index->pos[i + 1] - index->pos[i];
+    size_t old_pos = ref & ~REF_SOURCE;
+    if (!(ref & REF_SOURCE) || old_pos > rebase->old_len ||
+        len > rebase->old_len - old_pos)
+      continue;
+    rebase->moved[num_moved++] = (struct moved){
+        .old_pos = old_pos, .new_pos = index->pos[i], .len = len};
+  }
+  qsort(rebase->moved, num_moved, sizeof(struct moved), compare_moved);
+
+  // ranges copied to several places keep the first, overlaps are trimmed
+  size_t kept = 0, end = 0;
+  for (size_t i = 0; i < num_moved; i++) {
+    struct moved moved = rebase->moved[i];
+    if (moved.old_pos + moved.len <= end)
+      continue;
+    if (moved.old_pos < end) {
+      size_t skip = end - moved.old_pos;
+      moved.old_pos += skip;
+      moved.new_pos += skip;
+      moved.len -= skip;
+    }
+    rebase->moved[kept++] = moved;
+    end = moved.old_pos + moved.len;
+  }
+  rebase->num_moved = kept;
+  return 0;
+}
+
+// the window is rebuilt from the target and encoded with open-vcdiff, which
+// finds its ranges wherever they ended up in the new base
+static int reencode_window(struct rebase *rebase, struct target_stream *target,
+                           size_t start, size_t len) {
+  discard_window(&rebase->out);
+  if (rebase->encoder == NULL) {
+    rebase->encoder = window_encoder_new(rebase->new_data, rebase->new_len);
+    if (rebase->encoder == NULL)
+      return -ENOMEM;
+  }
+  if (rebase->window == NULL) {
+    rebase->window = malloc(WINDOW);
+    if (rebase->window == NULL)
+      return -ENOMEM;
+  }
+  int rc = read_range(target, start, len, rebase->window);
+  if (rc >= 0 && (size_t)rc < len)
+    rc = -EIO;
+  if (rc < 0)
+    return rc;
+
+  uint8_t *encoded;
+  size_t encoded_len;
+  rc = window_encode(rebase->encoder, rebase->window, len, &encoded,
+                     &encoded_len);
+  if (rc < 0)
+    return rc;
+  rc = write_all(rebase->out.fd, &(struct iovec){encoded, encoded_len}, 1);
+  free(encoded);
+  rebase->reencoded += len;
+  rebase->num_reencoded++;
+  return rc;
+}
+
+// writes the window with the diff's blocks pointed at the new base where all
+// of them are still there, and encodes it again otherwise
+static int rebase_window(struct rebase *rebase, struct target_stream *target,
+                         struct read_cursor *cursor, size_t start,
+                         size_t len) {
+  struct segment segments[SEGMENTS];
+  size_t offset = start;
+  rebase->broken = 0;
+  while (offset < start + len && !rebase->broken) {
+    int rc = map_range_cursor(target, cursor, offset, start + len - offset,
+                              segments, SEGMENTS);
+    if (rc == 0)
+      rc = -EIO;
+    if (rc < 0)
+      return rc;
+    size_t num_segments = rc;
+    for (size_t i = 0; i < num_segments && !rebase->broken; i++) {
+      rc = push_segment(rebase, &segments[i]);
+      if (rc < 0)
+        return rc;
+      offset += segments[i].len;
+    }
+  }
+  if (rebase->broken)
+    return reencode_window(rebase, target, start, len);
+  int rc = flush_op(&rebase->out);
+  if (rc >= 0)
+    rc = flush_window(&rebase->out);
+  return rc;
+}
+
+static int rebase_target(struct rebase *rebase, struct target_stream *target) {
+  int rc = write_all(rebase->out.fd,
+                     &(struct iovec){(void *)file_header, sizeof(file_header)},
+                     1);
+  struct read_cursor cursor = {0};
+  for (size_t offset = 0; offset < target->offset && rc >= 0;
+       offset += WINDOW) {
+    size_t len = target->offset - offset < WINDOW ? target->offset - offset
+                                                  : WINDOW;
+    rc = rebase_window(rebase, target, &cursor, offset, len);
+  }
+  return rc;
+}
+
+static int set_xattrs(int fd, const char *source_path, size_t target_len) {
+  char size[32];
+  int len = snprintf(size, sizeof(size), "%zu", target_len);
+  if (fsetxattr(fd, "user.diff_src", source_path, strlen(source_path), 0) <
+          0 ||
+      fsetxattr(fd, "user.diff_src_size", size, len, 0) < 0)
+    return -errno;
+  return 0;
+}
+
+static void usage(const char *progname) {
+  fprintf(stderr,
+          "Usage: %s [-d BASE_DIFF] [OLD] [NEW] [NEW_PATH] [DIFF] [OUT]\n"
+          "   Rebases DIFF from OLD onto NEW, NEW_PATH is the new base in the\n"
+          "   base directory. BASE_DIFF is a diff from OLD to NEW that tells\n"
+          "   where ranges of OLD moved, without it they are only found at\n"
+          "   the same offset of NEW, which reads every copied range of both\n"
+          "   bases. Windows with ranges that were not found are encoded\n"
+          "   again against NEW, as slow as the encoder.\n",
+          progname);
+}
+
+int main(int argc, char *argv[]) {
+  const char *base_diff_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "d:")) != -1) {
+    if (opt != 'd') {
+      usage(argv[0]);
+      return 1;
+    }
+    base_diff_path = optarg;
+  }
+  if (argc - optind != 5) {
+    usage(argv[0]);
+    return 1;
+  }
+  const char *old_path = argv[optind], *new_path = argv[optind + 1],
+             *source_path = argv[optind + 2], *diff_path = argv[optind + 3],
+             *out_path = argv[optind + 4];
+  // every copy is compared byte for byte, for large bases that dominates
+  if (!base_diff_path)
+    fprintf(stderr, "Note: without -d the copied ranges of %s and %s are "
+                    "compared, reading both bases in full\n",
+            old_path, new_path);
+
+  int old_fd = open(old_path, O_RDONLY);
+  if (old_fd < 0) {
+    perror("Error opening old base");
+    return 1;
+  }
+  int new_fd = open(new_path, O_RDONLY);
+  if (new_fd < 0) {
+    perror("Error opening new base");
+    return 1;
+  }
+  int base_diff_fd = -1;
+  if (base_diff_path) {
+    base_diff_fd = open(base_diff_path, O_RDONLY);
+    if (base_diff_fd < 0) {
+      perror("Error opening diff between the bases");
+      return 1;
+    }
+  }
+  int diff_fd = open(diff_path, O_RDONLY);
+  struct stat diff_stat;
+  if (diff_fd < 0 || fstat(diff_fd, &diff_stat) < 0) {
+    perror("Error opening diff");
+    return 1;
+  }
+
+  struct target_stream target, bases = {0};
+  struct source_stream source, old_source = {0}, new_source = {0};
+  struct rebase rebase = {0};
+  int rc = load_diff(&target, &source, old_fd, diff_fd);
+  if (rc < 0) {
+    fprintf(stderr, "Error loading diff: %s\n", strerror(-rc));
+    return 1;
+  }
+  rebase.old_data = source.data;
+  rebase.old_len = source.len;
+
+  rc = map_source(&new_source, new_fd);
+  rebase.new_data = new_source.data;
+  rebase.new_len = rebase.out.source_len = new_source.len;
+  if (rc >= 0 && base_diff_path) {
+    rc = load_diff(&bases, &old_source, old_fd, base_diff_fd);
+    if (rc >= 0 && bases.offset != rebase.new_len) {
+      fprintf(stderr, "%s does not patch %s into %s\n", base_diff_path,
+              old_path, new_path);
+      rc = -EINVAL;
+    }
+    if (rc >= 0)
+      rc = build_moved(&rebase, &bases);
+  }
+  if (rc < 0) {
+    fprintf(stderr, "Error loading new base: %s\n", strerror(-rc));
+    goto exit;
+  }
+
+  // written next to the output and renamed over it, so out may be the diff
+  char *tmp_path;
+  if (asprintf(&tmp_path, "%s.XXXXXX", out_path) < 0) {
+    rc = -ENOMEM;
+    goto exit;
+  }
+  rebase.out.fd = mkstemp(tmp_path);
+  if (rebase.out.fd < 0) {
+    rc = -errno;
+    fprintf(stderr, "Error creating %s: %s\n", tmp_path, strerror(-rc));
+    free(tmp_path);
+    goto exit;
+  }
+
+  rc = rebase_target(&rebase, &target);
+  if (rc >= 0)
+    rc = set_xattrs(rebase.out.fd, source_path, target.offset);
+  if (rc >= 0 && fchmod(rebase.out.fd, diff_stat.st_mode & 07777) < 0)
+    rc = -errno;
+  if (close(rebase.out.fd) < 0 && rc >= 0)
+    rc = -errno;
+  if (rc >= 0 && rename(tmp_path, out_path) < 0)
+    rc = -errno;
+  if (rc < 0) {
+    fprintf(stderr, "Error writing %s: %s\n", out_path, strerror(-rc));
+    unlink(tmp_path);
+  } else {
+    fprintf(stderr,
+            "%zu bytes copied from the new base, %zu bytes added, %zu bytes "
+            "in %zu windows encoded again\n",
+            rebase.out.copied, rebase.out.added, rebase.reencoded,
+            rebase.num_reencoded);
+    // encoding most of the target again costs as much as encoding it anew
+    if (rebase.reencoded > target.offset / 2)
+      fprintf(stderr,
+              "Warning: %zu%% of the target was encoded again%s\n",
+              rebase.reencoded * 100 / target.offset,
+              base_diff_path ? "" : ", a diff between the bases (-d) finds "
+                                    "moved ranges");
+  }
+  free(tmp_path);
+
+exit:
+  free(rebase.out.inst);
+  free(rebase.moved);
+  free(rebase.window);
+  if (rebase.encoder)
+    window_encoder_free(rebase.encoder);
+  if (base_diff_path)
+    free_data(&bases, &old_source);
+  unmap_source(&new_source);
+  free_data(&target, &source);
+  return rc < 0 ? 1 : 0;
+}
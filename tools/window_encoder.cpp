@@ -0,0 +1,55 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+
+#include "window_encoder.h"
+
+#include "google/vcencoder.h"
+
+struct window_encoder {
+  open_vcdiff::HashedDictionary dictionary;
+
+  window_encoder(const uint8_t *data, size_t len)
+      : dictionary(reinterpret_cast<const char *>(data), len, false) {}
+};
+
+struct window_encoder *window_encoder_new(const uint8_t *dictionary,
+                                          size_t len) {
+  try {
+    auto *encoder = new window_encoder(dictionary, len);
+    if (!encoder->dictionary.Init()) {
+      delete encoder;
+      return NULL;
+    }
+    return encoder;
+  } catch (const std::bad_alloc &) {
+    return NULL;
+  }
+}
+
+// the same as a window of the parallel encoder, its header is dropped
+int window_encode(struct window_encoder *encoder, const uint8_t *data,
+                  size_t len, uint8_t **out, size_t *out_len) {
+  try {
+    open_vcdiff::VCDiffStreamingEncoder stream(
+        &encoder->dictionary, open_vcdiff::VCD_FORMAT_INTERLEAVED, false);
+    std::string header, window;
+    if (!stream.StartEncoding(&header) ||
+        !stream.EncodeChunk(reinterpret_cast<const char *>(data), len,
+                            &window) ||
+        !stream.FinishEncoding(&window))
+      return -EIO;
+    *out = static_cast<uint8_t *>(malloc(window.size()));
+    if (*out == NULL)
+      return -ENOMEM;
+    memcpy(*out, window.data(), window.size());
+    *out_len = window.size();
+    return 0;
+  } catch (const std::bad_alloc &) {
+    return -ENOMEM;
+  }
+}
+
+void window_encoder_free(struct window_encoder *encoder) { delete encoder; }
@@ -0,0 +1,31 @@
+#ifndef WINDOW_ENCODER_H
+#define WINDOW_ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// encodes single windows against a dictionary with open-vcdiff, for tools
+// written in C that mostly produce their windows themselves
+struct window_encoder;
+
+// the dictionary is hashed once and has to stay mapped until the encoder is
+// freed, returns NULL if it could not be hashed
+struct window_encoder *window_encoder_new(const uint8_t *dictionary,
+                                          size_t len);
+
+// encodes data as one interleaved window without the file header, *out is
+// allocated with malloc and freed by the caller
+int window_encode(struct window_encoder *encoder, const uint8_t *data,
+                  size_t len, uint8_t **out, size_t *out_len);
+
+void window_encoder_free(struct window_encoder *encoder);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif